@@ -24,34 +24,53 @@
  */
 
 
+#include "display.h"
 #include "gnuplot.h"
+#include "histo.h"
+#include "rate.h"
+#include "recorder.h"
+#include "silenar.h"
+#include "slices.h"
 #include "utility.h"
 
 #include <fcntl.h>
 #include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <inttypes.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <time.h>
 #include <stdlib.h>
 #include <string.h>
 
 #define HIST_SIZE 8192
 #define DEV_PATH "/dev/silenar"
+#define BATCH_EVENTS 4096 ///< Size of the event buffer, in events
+#define WATERMARK 512     ///< Events the driver collects before a wakeup
+#define DISPLAY_FPS 4     ///< Updates of the plot per second
+#define SLICE_SEC 60      ///< Default length of a time slice
+#define SLICE_COUNT 60    ///< Default number of time slices kept
+#define PEAK_FWHM 20      ///< Default width of the peaks fitted on the plot
 
-//! \brief struct event defines the data for each SILENA ADC event
-//!
-struct event {
-  int32_t tv_sec;   ///< Event timestamp, seconds field
-  int32_t tv_usec;  ///< Event timestamp, microseconds field
-  uint32_t value;   ///< Event ADC value
-};
-
-int daq_go = 1;			///< A status variable, set to 1 when DAQ is active
+volatile sig_atomic_t daq_go = 1;	///< A status variable, set to 1 when DAQ is active
+volatile sig_atomic_t dump_go = 0;	///< Set by SIGUSR1 to dump the slices
 int fd = -1;			///< A file descriptor for the char device
 FILE * gnuplot = NULL;	///< A handle for the gnuplot pipe
+Display_Typedef display;	///< Plots the histogram from its own thread
+Histo_Typedef histo;	///< The spectrum, filled by the main thread only
+Recorder_Typedef recorder;	///< Writes the raw events, if requested
+Rate_Typedef rate;		///< Rates and inter-arrival times of the events
+Slices_Typedef slices;	///< The spectra of the last time slices
+
+struct event events [BATCH_EVENTS];	///< Filled by each read of the char device
+uint64_t reads = 0;		///< Successful read() calls
+uint64_t events_read = 0;	///< Events returned by those calls
 
 //! @brief Callback function that triggers the end of DAQ when a SIGINT signal
 //! is intercepted
@@ -59,23 +78,105 @@ FILE * gnuplot = NULL;	///< A handle for the gnuplot pipe
 //! @param signum is the number associated to the signal intercepted
 void SignalHandler (int signum);
 
+//! @brief Callback function that requests a dump of the time slices when a
+//! SIGUSR1 signal is intercepted
+//!
+//! @param signum is the number associated to the signal intercepted
+void DumpHandler (int signum);
+
 //! @brief Performs garbage collection of global variables before triggering
 //! program termination
 //!
 //! @param code is the termination code provided to the call of exit()
 void CleanExit (int code);
 
+//! @brief Prints the command line options
+//!
+//! @param name is the name of the program
+void PrintUsage (char const * name);
+
+//! @brief Prints the rates and the dead time measured on the timestamps of
+//! the events, and saves their inter-arrival time histogram
+//!
+//! @param rates are the rates at the end of the run
+//! @param path is the file for the inter-arrival time histogram, NULL if none
+void PrintRates (Rate_Summary const * rates, char const * path);
+
+//! @brief Prints the centroids of the peaks in the last time slice
+void PrintCentroids (void);
+
+//! @brief Prints the live time of the run and the true input rate against
+//! the rate of the accepted events
+void PrintLivetime (void);
+
+//! @brief Prints the events delivered per read() call and the CPU time the
+//! client spent per event
+//!
+//! @param start is the time the acquisition started, CLOCK_MONOTONIC
+void PrintReadStats (struct timespec const * start);
+
 int main(int argc, char * argv[]) {
-	struct event event;
-	int16_t histo [HIST_SIZE];
-	int retval, serviced;
+	struct timespec start;
+	ssize_t retval;
+	int count, opt;
 
-	UNUSED(argc);
-	UNUSED(argv);
+	Rate_Summary rates;
 
-	// Handle interruption of DAQ program
-	if (signal (SIGINT, &SignalHandler) == SIG_ERR) {
-		PRINT_STD_LIBERROR("signal");
+	// List-mode recording, off unless a prefix is given
+	char const * record_prefix = NULL;
+	char const * intervals_path = NULL;
+	int rotate_mib = 0, rotate_sec = 0;
+	bool direct = false;
+
+	// Time slices, dumped only if a prefix is given
+	char const * slices_prefix = NULL;
+	int slice_sec = SLICE_SEC, slice_count = SLICE_COUNT, slice_shift = 0;
+	Slices_Peak peaks [SLICES_PEAKS];
+	int npeaks = 0;
+	double fwhm = PEAK_FWHM;
+
+	while ((opt = getopt(argc, argv, "o:s:t:di:S:N:b:p:m:f:h")) != -1) {
+	  switch (opt) {
+	    case 'o': record_prefix = optarg; break;
+	    case 's': rotate_mib = atoi(optarg); break;
+	    case 't': rotate_sec = atoi(optarg); break;
+	    case 'd': direct = true; break;
+	    case 'i': intervals_path = optarg; break;
+	    case 'S': slice_sec = atoi(optarg); break;
+	    case 'N': slice_count = atoi(optarg); break;
+	    case 'b': slice_shift = atoi(optarg); break;
+	    case 'm': slices_prefix = optarg; break;
+	    case 'f': fwhm = atof(optarg); break;
+	    case 'p':
+	      if (npeaks == SLICES_PEAKS || sscanf(optarg, "%" SCNu32 ":%" SCNu32,
+	          &peaks[npeaks].lo, &peaks[npeaks].hi) != 2) {
+	        PrintUsage(argv[0]);
+	        return EXIT_FAILURE;
+	      }
+	      ++npeaks;
+	      break;
+	    default:
+	      PrintUsage(argv[0]);
+	      return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+	  }
+	}
+
+	// The ADCs after the first one are /dev/silenar1, /dev/silenar2...
+	char const * dev_path = optind < argc ? argv[optind] : DEV_PATH;
+
+	// Handle interruption of DAQ program. Without SA_RESTART the signals
+	// interrupt the blocking read, so an idle acquisition can be stopped
+	struct sigaction action;
+	memset(&action, 0, sizeof (action));
+	sigemptyset(&action.sa_mask);
+	action.sa_handler = &SignalHandler;
+	if (sigaction(SIGINT, &action, NULL) == -1) {
+		PRINT_STD_LIBERROR("sigaction");
+		CleanExit(EXIT_FAILURE);
+	}
+	action.sa_handler = &DumpHandler;
+	if (sigaction(SIGUSR1, &action, NULL) == -1) {
+		PRINT_STD_LIBERROR("sigaction");
 		CleanExit(EXIT_FAILURE);
 	}
 	
@@ -94,14 +195,44 @@ int main(int argc, char * argv[]) {
 	}
 	
 	// Open the char device
-	fd = open(DEV_PATH, O_RDWR, 0);
+	fd = open(dev_path, O_RDWR, 0);
 	if (fd == -1) {
 	  PRINT_DBGMSG("Could not open the char device!");
 	  CleanExit(EXIT_FAILURE);	  
 	}
 	
-	memset(histo, 0, sizeof (histo));
-	serviced = 0;
+	// Let the driver collect a batch before waking the client up. Fewer
+	// events are still delivered after the wake_usec module parameter
+	if (ioctl(fd, SILENAR_IOC_SET_WATERMARK, WATERMARK) == -1) {
+	  PRINT_STD_LIBERROR("ioctl");
+	}
+	
+	Rate_Init(&rate);
+	if (Slices_Init(&slices, HIST_SIZE, slice_shift, slice_sec,
+	    slice_count) == -1) {
+	  PRINT_STD_LIBERROR("Slices_Init");
+	  CleanExit(EXIT_FAILURE);
+	}
+	for (int p = 0; p < npeaks; ++p) {
+	  if (Slices_AddPeak(&slices, peaks[p].lo, peaks[p].hi) == -1) {
+	    PRINT_DBGMSG("Invalid peak region");
+	    CleanExit(EXIT_FAILURE);
+	  }
+	}
+	if (Histo_Init(&histo, HIST_SIZE, 1) == -1) {
+	  PRINT_DBGMSG("Could not allocate the histogram!");
+	  CleanExit(EXIT_FAILURE);
+	}
+	if (Display_Start(&display, gnuplot, HIST_SIZE, DISPLAY_FPS, fwhm) == -1) {
+	  PRINT_DBGMSG("Could not start the display thread!");
+	  CleanExit(EXIT_FAILURE);
+	}
+	if (record_prefix != NULL && Recorder_Start(&recorder, record_prefix,
+	    dev_path, rotate_mib, rotate_sec, direct) == -1) {
+	  PRINT_DBGMSG("Could not start the recorder!");
+	  CleanExit(EXIT_FAILURE);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
 	// Start the acquisition
     retval = write(fd, "S", 1);
@@ -113,21 +244,37 @@ int main(int argc, char * argv[]) {
 
 	
 	while (daq_go) {
-	  // Read one event at a time
-	  retval = read(fd, &event, sizeof (struct event));
-	  if (retval != sizeof (struct event) || retval == -1) {
-	    // Errore nella lettura
-	    PRINT_DBGMSG("Error in read operation.");
+	  if (dump_go) {
+	    dump_go = 0;
+	    if (slices_prefix != NULL) {
+	      Slices_Dump(&slices, slices_prefix);
+	    }
+	  }
+	  // Read all the events available, up to a full buffer. The driver only
+	  // returns whole events, a batch is usually shorter than the buffer
+	  retval = read(fd, events, sizeof (events));
+	  if (retval == -1) {
+	    if (errno != EINTR) {
+	      // Errore nella lettura
+	      PRINT_STD_LIBERROR("read");
+	    }
 	    continue;
 	  }
+	  count = retval / sizeof (struct event);
+	  ++reads;
+	  events_read += count;
 	  
-	  if ( 0 <= event.value && event.value < HIST_SIZE) {
-	    ++histo[event.value];
+	  Histo_Fill(&histo, 0, &events[0].value, sizeof (struct event), count);
+	  if (record_prefix != NULL) {
+	    Recorder_Write(&recorder, events, count);
 	  }
-	  
-	  if ((++serviced % 100) == 99) { // Plot every 100 events
-	    GNUPlot_Plot(gnuplot, histo, HIST_SIZE);		  
-	  }	
+	  Rate_Fill(&rate, events, count);
+	  if (Slices_Fill(&slices, events, count) && npeaks) {
+	    PrintCentroids();
+	  }
+	  // The display thread picks the snapshot up at its next frame
+	  Rate_Summarize(&rate, time(NULL), &rates);
+	  Display_Publish(&display, &histo, &rates);
 	}
 
 	// Stop the acquisition
@@ -139,17 +286,126 @@ int main(int argc, char * argv[]) {
 
 
 	PRINT_DBGMSG("Stopping acquisition.");
+	Rate_Summarize(&rate, time(NULL), &rates);
+	Display_Stop(&display, &histo, &rates);
+	Recorder_Stop(&recorder);
+	PrintReadStats(&start);
+	PrintRates(&rates, intervals_path);
+	if (slices_prefix != NULL) {
+	  Slices_Dump(&slices, slices_prefix);
+	}
+	PrintLivetime();
 	CleanExit(EXIT_SUCCESS);
 	return 0; // Never executed
 };
 
 
+void PrintUsage (char const * name) {
+	printf("usage: %s [-o prefix [-s MiB] [-t sec] [-d]] [-i file]\n"
+	       "       [-S sec] [-N slices] [-b shift] [-p lo:hi]... [-m prefix]"
+	       " [-f fwhm] [device]\n"
+	       "  device   the char device, " DEV_PATH " by default\n"
+	       "  -o       record the events in prefix_NNNN" LISTMODE_SUFFIX "\n"
+	       "  -s       start a new file every MiB megabytes\n"
+	       "  -t       start a new file every sec seconds\n"
+	       "  -d       write the files with O_DIRECT\n"
+	       "  -i       save the inter-arrival time histogram in file\n"
+	       "  -S       length of a time slice, %d s by default\n"
+	       "  -N       number of time slices kept, %d by default\n"
+	       "  -b       merge 2^shift channels in the time slices\n"
+	       "  -p       track the centroid of the peak between lo and hi\n"
+	       "  -m       dump the time slices in prefix.matrix and\n"
+	       "           prefix.centroids at the end and on SIGUSR1\n"
+	       "  -f       fit the peaks about fwhm channels wide on the plot,\n"
+	       "           %d by default, 0 to disable\n",
+	       name, SLICE_SEC, SLICE_COUNT, PEAK_FWHM);
+}
+
+void PrintCentroids (void) {
+	Slices_Info const * info = Slices_Last(&slices);
+
+	printf("slice %lld, %llu events:", (long long) info->start,
+	       (unsigned long long) info->events);
+	for (int p = 0; p < slices.npeaks; ++p) {
+	  printf(" %.2f +- %.2f", info->centroid[p], info->error[p]);
+	}
+	printf("\n");
+}
+
+void PrintRates (Rate_Summary const * rates, char const * path) {
+	FILE * out;
+
+	printf("rate %.1f / %.1f / %.1f ev/s over 1 / 10 / 60 s\n",
+	       rates->rate[0], rates->rate[1], rates->rate[2]);
+	printf("dead time %.1f us per event, %.2f %%, true rate %.1f ev/s\n",
+	       rates->dead_us, 100.0 * rates->dead_fraction, rates->true_rate);
+	if (path == NULL) {
+	  return;
+	}
+	out = fopen(path, "w");
+	if (out == NULL) {
+	  PRINT_STD_LIBERROR("fopen");
+	  return;
+	}
+	Rate_Print(&rate, out);
+	fclose(out);
+}
+
+void PrintLivetime (void) {
+	struct silenar_livetime lt;
+
+	if (ioctl(fd, SILENAR_IOC_GET_LIVETIME, &lt) == -1) {
+	  PRINT_STD_LIBERROR("ioctl");
+	  return;
+	}
+	if (lt.real_ns == 0 || lt.live_ns == 0) {
+	  return;
+	}
+	printf("real time %.3f s, live time %.3f s, dead time %.2f %%\n",
+	       lt.real_ns * 1e-9, lt.live_ns * 1e-9,
+	       100.0 * lt.dead_ns / lt.real_ns);
+	printf("input rate %.1f ev/s, accepted rate %.1f ev/s\n",
+	       lt.conversions * 1e9 / lt.live_ns, lt.accepted * 1e9 / lt.real_ns);
+}
+
+void PrintReadStats (struct timespec const * start) {
+	struct timespec stop;
+	struct rusage usage;
+	double elapsed, cpu;
+
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	if (getrusage(RUSAGE_SELF, &usage) == -1) {
+	  PRINT_STD_LIBERROR("getrusage");
+	  return;
+	}
+	elapsed = (stop.tv_sec - start->tv_sec) +
+	          (stop.tv_nsec - start->tv_nsec) * 1e-9;
+	cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6 +
+	      usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+	printf("%llu events in %llu reads, %.1f events/read\n",
+	       (unsigned long long) events_read, (unsigned long long) reads,
+	       reads ? (double) events_read / reads : 0.0);
+	if (events_read && elapsed > 0) {
+	  printf("cpu %.3f s (%.1f %%), %.3f us/event\n", cpu,
+	         100.0 * cpu / elapsed, cpu * 1e6 / events_read);
+	}
+}
+
 void SignalHandler (int signum) {
 	UNUSED(signum);
 	daq_go = 0;
 };
 
+void DumpHandler (int signum) {
+	UNUSED(signum);
+	dump_go = 1;
+};
+
 void CleanExit(int code) {
+	Display_Stop(&display, NULL, NULL);
+	Recorder_Stop(&recorder);
+	Histo_Free(&histo);
+	Slices_Free(&slices);
 	if (fd != -1) {
 		close(fd);
 	}
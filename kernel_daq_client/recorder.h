@@ -0,0 +1,364 @@
+/****************************************************************************
+ * Copyright (C) 2021 by Rodrigo Torres                                     *
+ *                                                                          *
+ *   This program free software: you can redistribute it and/or modify it   *
+ *   under the terms of the GNU Lesser General Public License as published  *
+ *   by the Free Software Foundation, either version 3 of the License, or   *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   This program is distributed in the hope that it will be useful,        *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU Lesser General Public License for more details.                    *
+ *                                                                          *
+ *   You should have received a copy of the GNU Lesser General Public       *
+ *   License along with this program.                                       *
+ ***************************************************************************/
+
+//! \file recorder.h
+//! \brief A writer thread that records the raw events in list-mode files,
+//! see listmode.h
+//!
+//! The acquisition thread copies each batch of events into a block with
+//! Recorder_Write() and hands the full blocks to the writer thread through a
+//! queue of RECORDER_BLOCKS buffers. The acquisition never waits for the
+//! disk: when every buffer is queued the events are dropped, counted, and
+//! reported in the header of the next block that is recorded.
+
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include "listmode.h"
+#include "utility.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+//! \def RECORDER_BLOCKS
+//! \brief Number of block buffers, how long the disk may stall before
+//! events are dropped
+#define RECORDER_BLOCKS 16
+//! \def RECORDER_ALIGN
+//! \brief Alignment of the buffers and of the writes, required by O_DIRECT
+#define RECORDER_ALIGN 4096
+
+typedef struct {
+	char const * prefix;	///< Files are named <prefix>_NNNN.slm
+	uint64_t rotate_bytes;	///< Size that starts a new file, 0 to never rotate
+	int rotate_sec;			///< Age that starts a new file, 0 to never rotate
+	bool direct;			///< Open the files with O_DIRECT
+	struct listmode_run * run;	///< Run header, aligned buffer
+
+	char * blocks;			///< RECORDER_BLOCKS aligned block buffers
+	atomic_uint head;		///< Blocks handed to the writer thread
+	atomic_uint tail;		///< Blocks written by the writer thread
+	sem_t queued;			///< Posted once per block handed over, and on stop
+
+	// Owned by the acquisition thread
+	uint32_t fill;			///< Events in the block being filled
+	uint64_t sequence;		///< Blocks started in the run
+	uint64_t events;		///< Events recorded or queued in the run
+	uint64_t lost;			///< Events dropped since the last block
+
+	// Owned by the writer thread
+	int fd;					///< Current file, -1 if none
+	uint64_t file_bytes;	///< Bytes written to the current file
+	time_t file_start;		///< Time the current file was opened
+	int error;				///< Set after the first failed write
+	atomic_uint_fast64_t dropped;	///< Events lost, by either thread
+	atomic_uint_fast64_t written;	///< Blocks written to disk
+	atomic_uint_fast64_t recorded;	///< Events written to disk
+
+	atomic_bool run_flag;	///< Cleared to stop the writer thread
+	pthread_t thread;		///< The writer thread
+} Recorder_Typedef;
+
+//! \brief Allocates the buffers and starts the writer thread. The first file
+//! is opened by the writer thread with the first block
+//!
+//! Both rotations are checked when a block is written. O_DIRECT requires
+//! _GNU_SOURCE, which the Makefile defines
+//!
+//! \param rec is the recorder to start
+//! \param prefix is the path of the files without the _NNNN.slm suffix
+//! \param device is the path of the char device, saved in the run header
+//! \param rotate_mib starts a new file when the current one reaches it, 0 to
+//! never rotate by size
+//! \param rotate_sec starts a new file when the current one is that old, 0 to
+//! never rotate by time
+//! \param direct opens the files with O_DIRECT, bypassing the page cache
+//!
+//! \return 0 on success, -1 otherwise
+static int Recorder_Start(Recorder_Typedef * rec, char const * prefix,
+		char const * device, int rotate_mib, int rotate_sec, bool direct);
+
+//! \brief Copies a batch of events into the current block, handing the block
+//! to the writer thread when it is full. Never blocks
+//!
+//! \param rec is a started recorder
+//! \param events are the events
+//! \param count is the number of events
+static void Recorder_Write(Recorder_Typedef * rec, struct event const * events,
+		int count);
+
+//! \brief Hands the last partial block over, waits for the writer thread to
+//! write every queued block and closes the file
+//!
+//! \param rec is a started recorder, or a zeroed one
+static void Recorder_Stop(Recorder_Typedef * rec);
+
+//! \brief Returns the buffer of a block
+//!
+//! \param rec is the recorder
+//! \param idx is a free running block index
+static inline struct listmode_block * Recorder_Block(Recorder_Typedef * rec,
+		unsigned idx) {
+	return (struct listmode_block *)
+			(rec->blocks + (size_t) (idx % RECORDER_BLOCKS) * LISTMODE_BLOCK_SIZE);
+}
+
+//! \brief Closes the current file and opens the next one of the run, writing
+//! its run header
+//!
+//! \param rec is the recorder
+//!
+//! \return 0 on success, -1 otherwise
+static int Recorder_Rotate(Recorder_Typedef * rec) {
+	char path [PATH_MAX];
+	int flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+	if (rec->fd != -1) {
+		close(rec->fd);
+		rec->fd = -1;
+		++rec->run->file_index;
+	}
+	snprintf(path, sizeof (path), "%s_%04u" LISTMODE_SUFFIX, rec->prefix,
+			rec->run->file_index);
+	if (rec->direct) {
+		flags |= O_DIRECT;
+	}
+	rec->fd = open(path, flags, 0644);
+	if (rec->fd == -1 && rec->direct && errno == EINVAL) {
+		// Some file systems, tmpfs for one, do not support O_DIRECT
+		PRINT_DBGMSG("O_DIRECT not supported, using the page cache");
+		rec->direct = false;
+		rec->fd = open(path, flags & ~O_DIRECT, 0644);
+	}
+	if (rec->fd == -1) {
+		PRINT_STD_LIBERROR("open");
+		return -1;
+	}
+	if (write(rec->fd, rec->run, LISTMODE_RUN_SIZE) != LISTMODE_RUN_SIZE) {
+		PRINT_STD_LIBERROR("write");
+		// A file without its run header is not part of the run
+		close(rec->fd);
+		rec->fd = -1;
+		unlink(path);
+		return -1;
+	}
+	rec->file_bytes = LISTMODE_RUN_SIZE;
+	rec->file_start = time(NULL);
+	return 0;
+}
+
+//! \brief Body of the writer thread
+//!
+//! \param arg is a pointer to the Recorder_Typedef
+static void * Recorder_Thread(void * arg) {
+	Recorder_Typedef * rec = arg;
+	struct listmode_block * block;
+	unsigned tail;
+
+	for (;;) {
+		while (sem_wait(&rec->queued) == -1 && errno == EINTR) {
+		}
+		tail = atomic_load_explicit(&rec->tail, memory_order_relaxed);
+		if (tail == atomic_load_explicit(&rec->head, memory_order_acquire)) {
+			if (!atomic_load(&rec->run_flag)) {
+				break; // Stopped, and every block was written
+			}
+			continue;
+		}
+		block = Recorder_Block(rec, tail);
+
+		if (!rec->error && (rec->fd == -1 ||
+				(rec->rotate_bytes && rec->file_bytes + LISTMODE_BLOCK_SIZE >
+						rec->rotate_bytes) ||
+				(rec->rotate_sec && time(NULL) - rec->file_start >=
+						rec->rotate_sec))) {
+			rec->error = Recorder_Rotate(rec);
+		}
+		if (!rec->error) {
+			if (write(rec->fd, block, LISTMODE_BLOCK_SIZE) == LISTMODE_BLOCK_SIZE) {
+				rec->file_bytes += LISTMODE_BLOCK_SIZE;
+				atomic_fetch_add(&rec->written, 1);
+				atomic_fetch_add(&rec->recorded, block->events);
+			} else {
+				PRINT_STD_LIBERROR("write");
+				rec->error = -1;
+			}
+		}
+		if (rec->error) {
+			// Keep draining the queue, the acquisition goes on without disk
+			atomic_fetch_add(&rec->dropped, block->events);
+		}
+		atomic_store_explicit(&rec->tail, tail + 1, memory_order_release);
+	}
+	if (rec->fd != -1) {
+		close(rec->fd);
+		rec->fd = -1;
+	}
+	return NULL;
+}
+
+static int Recorder_Start(Recorder_Typedef * rec, char const * prefix,
+		char const * device, int rotate_mib, int rotate_sec, bool direct) {
+	struct timespec now;
+	sigset_t all, old;
+
+	memset(rec, 0, sizeof (*rec));
+	rec->fd           = -1;
+	rec->prefix       = prefix;
+	rec->rotate_bytes = (uint64_t) rotate_mib << 20;
+	rec->rotate_sec   = rotate_sec;
+	rec->direct       = direct;
+
+	rec->run    = aligned_alloc(RECORDER_ALIGN, LISTMODE_RUN_SIZE);
+	rec->blocks = aligned_alloc(RECORDER_ALIGN,
+			(size_t) RECORDER_BLOCKS * LISTMODE_BLOCK_SIZE);
+	if (rec->run == NULL || rec->blocks == NULL) {
+		PRINT_STD_LIBERROR("aligned_alloc");
+		Recorder_Stop(rec);
+		return -1;
+	}
+	memset(rec->run, 0, LISTMODE_RUN_SIZE);
+	clock_gettime(CLOCK_REALTIME, &now);
+	rec->run->magic        = LISTMODE_RUN_MAGIC;
+	rec->run->version      = LISTMODE_VERSION;
+	rec->run->run_size     = LISTMODE_RUN_SIZE;
+	rec->run->block_size   = LISTMODE_BLOCK_SIZE;
+	rec->run->event_format = SILENAR_FORMAT_LEGACY;
+	rec->run->event_size   = sizeof (struct event);
+	rec->run->start_ns     = now.tv_sec * 1000000000LL + now.tv_nsec;
+	strncpy(rec->run->device, device, sizeof (rec->run->device) - 1);
+
+	if (sem_init(&rec->queued, 0, 0) == -1) {
+		PRINT_STD_LIBERROR("sem_init");
+		Recorder_Stop(rec);
+		return -1;
+	}
+	atomic_init(&rec->run_flag, true);
+
+	// Like the display thread, leave SIGINT to the acquisition thread
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	errno = pthread_create(&rec->thread, NULL, &Recorder_Thread, rec);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (errno) {
+		PRINT_STD_LIBERROR("pthread_create");
+		atomic_store(&rec->run_flag, false);
+		sem_destroy(&rec->queued);
+		Recorder_Stop(rec);
+		return -1;
+	}
+	return 0;
+}
+
+//! \brief Completes the block being filled and hands it to the writer thread
+//!
+//! \param rec is the recorder
+//! \param last is the last event stored in the block
+static void Recorder_Submit(Recorder_Typedef * rec, struct event const * last) {
+	unsigned head = atomic_load_explicit(&rec->head, memory_order_relaxed);
+	struct listmode_block * block = Recorder_Block(rec, head);
+	size_t used = sizeof (*block) + rec->fill * sizeof (struct event);
+
+	block->events  = rec->fill;
+	block->last_us = last->tv_sec * 1000000LL + last->tv_usec;
+	memset((char *) block + used, 0, LISTMODE_BLOCK_SIZE - used);
+	rec->fill = 0;
+
+	atomic_store_explicit(&rec->head, head + 1, memory_order_release);
+	sem_post(&rec->queued);
+}
+
+static void Recorder_Write(Recorder_Typedef * rec, struct event const * events,
+		int count) {
+	struct listmode_block * block;
+	unsigned head;
+	uint32_t n;
+
+	while (count > 0) {
+		head = atomic_load_explicit(&rec->head, memory_order_relaxed);
+		if (head - atomic_load_explicit(&rec->tail, memory_order_acquire) ==
+				RECORDER_BLOCKS) {
+			// Every buffer waits for the disk, drop rather than wait
+			rec->lost += count;
+			atomic_fetch_add(&rec->dropped, count);
+			return;
+		}
+		block = Recorder_Block(rec, head);
+		if (rec->fill == 0) {
+			block->magic       = LISTMODE_BLOCK_MAGIC;
+			block->sequence    = rec->sequence++;
+			block->first_event = rec->events;
+			block->lost        = rec->lost;
+			block->first_us    = events->tv_sec * 1000000LL + events->tv_usec;
+			block->reserved[0] = block->reserved[1] = 0;
+			rec->lost = 0;
+		}
+		n = LISTMODE_BLOCK_EVENTS - rec->fill;
+		if (n > (uint32_t) count) {
+			n = count;
+		}
+		memcpy((struct event *) (block + 1) + rec->fill, events,
+				n * sizeof (struct event));
+		rec->fill   += n;
+		rec->events += n;
+		events      += n;
+		count       -= n;
+		if (rec->fill == LISTMODE_BLOCK_EVENTS) {
+			Recorder_Submit(rec, events - 1);
+		}
+	}
+}
+
+static void Recorder_Stop(Recorder_Typedef * rec) {
+	if (atomic_load(&rec->run_flag)) {
+		if (rec->fill) {
+			struct listmode_block * block = Recorder_Block(rec,
+					atomic_load_explicit(&rec->head, memory_order_relaxed));
+			Recorder_Submit(rec, (struct event const *) (block + 1) +
+					rec->fill - 1);
+		}
+		atomic_store(&rec->run_flag, false);
+		sem_post(&rec->queued);
+		pthread_join(rec->thread, NULL);
+		sem_destroy(&rec->queued);
+		printf("recorded %llu events in %llu blocks, %u files, %llu dropped\n",
+				(unsigned long long) atomic_load(&rec->recorded),
+				(unsigned long long) atomic_load(&rec->written),
+				atomic_load(&rec->written) ? rec->run->file_index + 1 : 0,
+				(unsigned long long) atomic_load(&rec->dropped));
+	}
+	free(rec->run);
+	free(rec->blocks);
+	rec->run    = NULL;
+	rec->blocks = NULL;
+}
+
+#endif // RECORDER_H
@@ -0,0 +1,69 @@
+#!/bin/sh
+# Sets up a gpio-sim chip with the 18 lines of one Silena ADC, so that
+# silenar and readout_bench can run without the Silena and the Raspberry Pi.
+#
+#   ./gpio_sim.sh up     creates the chip and prints how to load silenar
+#   ./gpio_sim.sh down   removes the chip, unload silenar first
+#
+# The lines follow the order of the pins module parameter: D00 to D12, RUN,
+# ENB, LVE, RDY and ACK. Needs root, configfs and CONFIG_GPIO_SIM.
+
+set -e
+
+CONFIGFS=/sys/kernel/config/gpio-sim
+CHIP=$CONFIGFS/${SILENAR_SIM:-silenar}
+LINES="D00 D01 D02 D03 D04 D05 D06 D07 D08 D09 D10 D11 D12 RUN ENB LVE RDY ACK"
+
+up() {
+  modprobe gpio-sim
+  if ! mountpoint -q /sys/kernel/config; then
+    mount -t configfs none /sys/kernel/config
+  fi
+  mkdir "$CHIP" "$CHIP/bank0"
+  echo 18 > "$CHIP/bank0/num_lines"
+  k=0
+  for name in $LINES; do
+    mkdir "$CHIP/bank0/line$k"
+    echo "$name" > "$CHIP/bank0/line$k/name"
+    k=$((k + 1))
+  done
+  echo 1 > "$CHIP/live"
+
+  dev=$(cat "$CHIP/dev_name")
+  chip=$(cat "$CHIP/bank0/chip_name")
+
+  # silenar requests the lines by their global number, the base of the chip
+  base=
+  for d in /sys/class/gpio/gpiochip*; do
+    [ -e "$d/device" ] || continue
+    case $(basename "$(readlink -f "$d/device")") in
+      "$chip"|"$dev") base=$(cat "$d/base") ;;
+    esac
+  done
+  if [ -z "$base" ] && [ -r /sys/kernel/debug/gpio ]; then
+    base=$(sed -n "s/^$chip: GPIOs \([0-9]*\)-.*/\1/p" /sys/kernel/debug/gpio)
+  fi
+  if [ -z "$base" ]; then
+    echo "$chip is live, but its base could not be found:" \
+         "enable CONFIG_GPIO_SYSFS or mount debugfs" >&2
+    exit 1
+  fi
+
+  echo "gpio-sim chip $chip, lines $base-$((base + 17))"
+  echo "  insmod silenar.ko pins=$(seq -s , "$base" $((base + 17)))"
+  echo "  ./readout_bench /sys/devices/platform/$dev/$chip"
+}
+
+down() {
+  echo 0 > "$CHIP/live"
+  for line in "$CHIP"/bank0/line*; do
+    rmdir "$line"
+  done
+  rmdir "$CHIP/bank0" "$CHIP"
+}
+
+case $1 in
+  up) up ;;
+  down) down ;;
+  *) echo "usage: $0 up|down" >&2; exit 1 ;;
+esac
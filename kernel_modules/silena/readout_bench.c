@@ -0,0 +1,201 @@
+//! \file readout_bench.c
+//! \brief Test and benchmark of the silenar bus readout on a gpio-sim chip
+//!
+//! The chip set up by gpio_sim.sh stands for the Silena: for every event the
+//! benchmark drives the data lines to an ADC value through the pulls of the
+//! simulated lines, pulls RDY low to trigger the conversion interrupt and
+//! waits for silenar to store the event. At the end it reads the events back
+//! and checks their values, then reports the readout cost per event measured
+//! by the driver, see silenar_stats.readout_ns.
+//!
+//!   gcc -O2 -Wall -I. readout_bench.c -o readout_bench
+//!   ./readout_bench [-n events] [-d device] /sys/devices/platform/gpio-sim.N/gpiochipM
+
+#include "silenar.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BUS_WIDTH 13
+#define LINE_LVE 15   ///< Offsets of the control lines, see gpio_sim.sh
+#define LINE_RDY 16
+#define LINE_ACK 17
+#define TIMEOUT_NS 1000000000LL ///< Longest wait for the driver to store an event
+
+//! \brief Returns CLOCK_MONOTONIC in nanoseconds
+static int64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+//! \brief Opens an attribute of a simulated line
+//! \param chip is the sysfs directory of the gpio-sim chip
+//! \param line is the offset of the line
+//! \param attr is "pull" or "value"
+static int line_open(char const * chip, int line, char const * attr) {
+  char path[512];
+  int fd;
+
+  snprintf(path, sizeof (path), "%s/sim_gpio%d/%s", chip, line, attr);
+  fd = open(path, attr[0] == 'p' ? O_WRONLY : O_RDONLY);
+  if (fd == -1) {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+  return fd;
+}
+
+//! \brief Drives a simulated input line high or low
+//! \param fd is the pull attribute of the line
+//! \param high is the level
+static void line_set(int fd, int high) {
+  char const * pull = high ? "pull-up" : "pull-down";
+  if (pwrite(fd, pull, strlen(pull), 0) < 0) {
+    perror("pull");
+    exit(EXIT_FAILURE);
+  }
+}
+
+//! \brief Returns the number of conversions the driver read so far
+//! \param fd is the device
+//! \param stats receives the statistics
+static uint64_t conversions(int fd, struct silenar_stats * stats) {
+  if (ioctl(fd, SILENAR_IOC_GET_STATS, stats)) {
+    perror("SILENAR_IOC_GET_STATS");
+    exit(EXIT_FAILURE);
+  }
+  return stats->events + stats->below_lld + stats->above_uld;
+}
+
+int main(int argc, char * argv[]) {
+  char const * device = "/dev/silenar";
+  struct silenar_format format = { .format = SILENAR_FORMAT_NATIVE };
+  struct silenar_stats start, stop;
+  struct silenar_event * events;
+  int bus[BUS_WIDTH], level[BUS_WIDTH];
+  int fd, rdy, ack, lve, opt, j, k, n = 10000, bad = 0;
+  int64_t t0, t1, deadline;
+  uint32_t * values;
+  uint64_t done;
+  ssize_t got;
+  char ackv;
+
+  while ((opt = getopt(argc, argv, "n:d:h")) != -1) {
+    switch (opt) {
+    case 'n': n = atoi(optarg); break;
+    case 'd': device = optarg; break;
+    default:
+      fprintf(stderr, "usage: %s [-n events] [-d device] chip_sysfs_dir\n",
+              argv[0]);
+      return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+  if (optind != argc - 1 || n < 1) {
+    fprintf(stderr, "usage: %s [-n events] [-d device] chip_sysfs_dir\n",
+            argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  // Idle lines before the driver requests them: RDY high, the Silena live
+  for (k = 0; k < BUS_WIDTH; ++k) {
+    bus[k] = line_open(argv[optind], k, "pull");
+    level[k] = -1;
+  }
+  rdy = line_open(argv[optind], LINE_RDY, "pull");
+  lve = line_open(argv[optind], LINE_LVE, "pull");
+  ack = line_open(argv[optind], LINE_ACK, "value");
+  line_set(rdy, 1);
+  line_set(lve, 0);
+
+  fd = open(device, O_RDWR | O_NONBLOCK);
+  if (fd == -1) {
+    perror(device);
+    return EXIT_FAILURE;
+  }
+  if (ioctl(fd, SILENAR_IOC_SET_FORMAT, &format)) {
+    perror("SILENAR_IOC_SET_FORMAT");
+    return EXIT_FAILURE;
+  }
+  done = conversions(fd, &start);
+  // Every event must still be in the ring when it is read back
+  if ((uint32_t) n >= start.size) {
+    n = start.size - 1;
+  }
+  values = malloc(n * sizeof (*values));
+  events = malloc(n * sizeof (*events));
+  if (!values || !events) {
+    perror("malloc");
+    return EXIT_FAILURE;
+  }
+
+  t0 = now_ns();
+  for (j = 0; j < n; ++j) {
+    // The bus is active low, like the Silena drives it
+    values[j] = (j * 2654435761u >> 7) & 0x1FFF;
+    for (k = 0; k < BUS_WIDTH; ++k) {
+      int high = !((values[j] >> k) & 1);
+      if (level[k] != high) {
+        line_set(bus[k], high);
+        level[k] = high;
+      }
+    }
+    line_set(rdy, 0);
+    deadline = now_ns() + TIMEOUT_NS;
+    while (conversions(fd, &stop) == done) {
+      if (now_ns() > deadline) {
+        fprintf(stderr, "event %d was not read, is silenar bound to the "
+                "lines of the chip?\n", j);
+        return EXIT_FAILURE;
+      }
+    }
+    ++done;
+    line_set(rdy, 1);
+  }
+  t1 = now_ns();
+
+  // The driver must release ACK after every conversion
+  if (pread(ack, &ackv, 1, 0) != 1 || ackv != '0') {
+    fprintf(stderr, "ACK is stuck high\n");
+    ++bad;
+  }
+  for (j = 0; j < n; j += got / sizeof (*events)) {
+    got = read(fd, events + j, (n - j) * sizeof (*events));
+    if (got <= 0) {
+      fprintf(stderr, "only %d of %d events read back: %s\n", j, n,
+              got ? strerror(errno) : "end of file");
+      return EXIT_FAILURE;
+    }
+  }
+  for (j = 0; j < n; ++j) {
+    if (events[j].value != values[j]) {
+      if (bad < 10) {
+        fprintf(stderr, "event %d: read %u, expected %u\n", j,
+                events[j].value, values[j]);
+      }
+      ++bad;
+    }
+  }
+
+  conversions(fd, &stop);
+  n = stop.events - start.events;
+  printf("%d events, %d wrong\n", n, bad);
+  printf("readout_ns %.0f per event, max %" PRIu32 "\n",
+         (double) (stop.readout_ns - start.readout_ns) / n, stop.readout_max_ns);
+  printf("ack_ns     %.0f per event, max %" PRIu32 "\n",
+         (double) (stop.ack_ns - start.ack_ns) / n, stop.ack_max_ns);
+  printf("cycle_ns   %.0f per event, driving the lines included\n",
+         (double) (t1 - t0) / n);
+
+  close(fd);
+  free(values);
+  free(events);
+  return bad ? EXIT_FAILURE : EXIT_SUCCESS;
+}
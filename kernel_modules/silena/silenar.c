@@ -1,13 +1,36 @@
 #include <linux/cdev.h>
+#include <linux/debugfs.h>
 #include <linux/device.h>
 #include <linux/delay.h>
 #include <linux/fs.h>
 #include <linux/gpio.h>
+#include <linux/gpio/consumer.h>
+#include <linux/hrtimer.h>
 #include <linux/interrupt.h>
+#include <linux/kthread.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/random.h>
+#include <linux/rculist.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
 //schead
 
+#include "silenar.h"
+#include "silenar_ring.h"
+
+#define CREATE_TRACE_POINTS
+#include "silenar_trace.h"
+
 MODULE_LICENSE("GPL");
 
 //! \file silenar.c
@@ -16,9 +39,9 @@ MODULE_LICENSE("GPL");
 //! \def NAME
 //! \brif The name of this kernel module
 #define NAME "silenar"
-//! \def DEV_NUM
-//! \brief The number of minor devices requested to the kernel
-#define DEV_NUM 1
+//! \def ADC_MAX
+//! \brief The maximum number of minor devices, one for each ADC
+#define ADC_MAX 4
 //! \def BASE_MINOR
 //! \brief The starting index for the device minor
 #define BASE_MINOR 0
@@ -38,85 +61,278 @@ MODULE_LICENSE("GPL");
 if (debug) \
   printk(KERN_ALERT "%s: %s -" msg ,HERE, ##__VA_ARGS__)
 
-#define EVENTS_SIZE sizeof (struct event)
+#define EVENTS_SIZE sizeof (struct silenar_event)
 
-#define SIZE 10000
+//! \def HISTO_BYTES
+//! \brief The size in bytes of one histogram of the histogram mode
+#define HISTO_BYTES (SILENAR_HISTO_BINS * sizeof (u64))
+//! \def SIM_TICK_NS
+//! \brief Period of the timer of the simulated ADC, in nanoseconds
+#define SIM_TICK_NS 1000000
+//! \def SIM_BURST_MAX
+//! \brief The maximum number of events generated by one simulation tick, it
+//! bounds the time spent in the softirq
+#define SIM_BURST_MAX 256
+//! \def SIM_CATCH_UP_NS
+//! \brief Period of the timer of the simulated ADC while it is behind
+#define SIM_CATCH_UP_NS 20000
+//! \def SIM_LAG_MAX_NS
+//! \brief Events that are late by more than this are given up
+#define SIM_LAG_MAX_NS (10 * SIM_TICK_NS)
+//! \def SIM_PEAKS_MAX
+//! \brief The maximum number of peaks of the simulated spectrum
+#define SIM_PEAKS_MAX 8
+//! \def RING_MIN
+//! \brief The minimum number of event slots in the ring
+#define RING_MIN 1024
+//! \def RING_MAX
+//! \brief The maximum number of event slots in the ring
+#define RING_MAX (1 << 24)
+//! \def LAT_BINS
+//! \brief Number of bins of the latency histograms, bin k counts latencies
+//! between 2^k and 2^(k+1) - 1 ns
+#define LAT_BINS 32
+//! \def RATE_WINDOW_NS
+//! \brief Shortest interval over which the RDY interrupt rate is measured
+#define RATE_WINDOW_NS 1000000
+//! \def POLL_BUDGET
+//! \brief Checks of the RDY line between two reschedule points of the
+//! polling thread
+#define POLL_BUDGET 256
+//! \def READ_RETRIES
+//! \brief Copies a read attempts while the producer keeps overwriting the
+//! first event copied, before giving up with -EAGAIN
+#define READ_RETRIES 8
 #define WRITE_BUF 32
 
-#define GPIO_RUN 23
-#define GPIO_ENB 24
-#define GPIO_RDY 26
-#define GPIO_ACK 27
+//! \def BUS_WIDTH
+//! \brief The number of lines of the ADC parallel data bus, the first
+//! entries of the GPIO table
+#define BUS_WIDTH 13
 
+// The discriminator settings are packed in one word, so that the producer
+// never sees the thresholds of one setting with the rebinning of another
+#define DISCR(lld, uld, rebin) ((lld) | ((uld) << 13) | ((rebin) << 26))
+#define DISCR_LLD(discr) ((discr) & 0x1FFF)
+#define DISCR_ULD(discr) (((discr) >> 13) & 0x1FFF)
+#define DISCR_REBIN(discr) ((discr) >> 26)
+//! \def PIN_RUN
+//! \brief Indexes of the control lines in the GPIO table
+#define PIN_RUN 13
+#define PIN_ENB 14
+#define PIN_LVE 15
+#define PIN_RDY 16
+#define PIN_ACK 17
+#define PIN_NUM 18
 
-//! \brief struct event defines the data for each SILENA ADC event
-//!
-struct event {
-  int32_t tv_sec;   ///< Event timestamp, seconds field
-  int32_t tv_usec;  ///< Event timestamp, microseconds field
-  uint32_t value;   ///< Event ADC value
+//! \brief struct silenar_pin is one line of the GPIO table
+struct silenar_pin {
+  unsigned int gpio;    ///< Global GPIO number
+  bool output;          ///< Driven by the Raspberry Pi, low once requested
+  char const * label;   ///< Name of the line
 };
 
-//! \brief struct driver_data defines the private data of the char device
-//! of the SILENA DAQ
+//! \brief struct driver_data defines the private data of one minor of the
+//! char device, one for each SILENA ADC
 //!
+//! The circular data buffer lives in a vmalloc area that can be mapped by
+//! userspace: the first page holds the \see silenar_ring_header, the event
+//! slots start on the following page. The producer never waits for the
+//! readers, it overwrites the oldest slot when the ring is full.
 struct driver_data {
-  int rdyirq;   ///<
-  int fHang;    ///<
-  int fDone;    ///< Letture e' stata fata
-  atomic_t write_idx;         ///< Write index of circular data buffer
-  atomic_t read_idx;          ///< Read index of cicular data buffer
-  struct event events[SIZE];  ///< Circular data buffer
+  struct silenar_pin gpios[PIN_NUM]; ///< GPIO table of this ADC
+  int minor;    ///< Minor number of the ADC, reported by the tracepoints
+  int rdyirq;   ///< IRQ number of the RDY line
+  u64 irq_ns;   ///< Time of the last RDY interrupt, taken by the hard handler
+  u32 discr;    ///< Thresholds and rebinning of the discriminator, see DISCR
+  int lveirq;   ///< IRQ number of the LVE line
+  u64 rate_since;     ///< Start of the current interrupt rate window
+  u32 rate_events;    ///< Interrupts in the current rate window
+  bool polling;       ///< RDY is masked, \a poll_task drains the conversions
+  u64 mode_since;     ///< Time of the last switch between interrupts and polling
+  struct task_struct * poll_task; ///< Polling thread, only with the Silena
+  struct silenar_ring ring;  ///< Circular data buffer
+  wait_queue_head_t queue;   ///< Readers waiting for events
+  struct mutex lock;  ///< Serializes the hardware setup against open/close
+  int users;          ///< Number of open files, the hardware is set up by the
+                      ///< first open and released by the last close
+  struct list_head readers;   ///< Open files, RCU protected for the producer
+  spinlock_t stats_lock;      ///< Protects \a stats and \a full_since
+  struct silenar_stats stats; ///< Ring statistics of the current acquisition
+  u64 full_since;     ///< Time the ring became full, 0 if it is not full
+  bool running;       ///< Set between the start and the stop of a run
+  u64 run_start;      ///< Time the current run started
+  u64 run_events;     ///< Events stored before the current run started
+  u64 dead_since;     ///< Time the Silena became dead, 0 if it is live
+  struct silenar_livetime livetime; ///< Dead time of the current run, also
+                                    ///< protected by \a stats_lock
+  u32 since_wake;     ///< Events stored since the readers were last woken
+  u64 wake_ns;        ///< Time the readers were last woken
+  u64 irq_hist[LAT_BINS];   ///< RDY interrupt to the end of the readout
+  u64 wake_hist[LAT_BINS];  ///< Wakeup to read of the readers that blocked
+  struct dentry * debugfs;  ///< Directory of the histograms in debugfs
+  struct hrtimer wake_timer;  ///< Bounds the latency of batched wakeups
+  int timer_armed;    ///< Set while events wait for \a wake_timer to expire
+  bool simulated;     ///< Events come from the simulated ADC, not the Silena
+  struct hrtimer sim_timer;   ///< Generates the events of the simulated ADC
+  struct rnd_state sim_rnd;   ///< Random state of the simulated ADC
+  u64 sim_next;       ///< Arrival time of the next simulated event
+  struct gpio_desc * bus[BUS_WIDTH];  ///< Descriptors of the data bus lines
+  struct gpio_desc * ack;             ///< Descriptor of the ACK line
+  struct gpio_desc * lve;             ///< Descriptor of the LVE line
+  struct gpio_desc * rdy;             ///< Descriptor of the RDY line
+  struct gpio_desc * run;             ///< Descriptor of the RUN line
+  struct gpio_desc * enb;             ///< Descriptor of the ENB line
+};
+
+//! \brief struct reader_data defines the private data of each open file
+//!
+//! Every reader has its own cursor on the shared ring, stored in a page that
+//! can be mapped by userspace. In histogram mode the reader does not consume
+//! events: the producer fills its live histogram instead, which is swapped
+//! with a zeroed spare one and merged into \a histo by every snapshot.
+struct reader_data {
+  struct driver_data * ddata;       ///< The device this file reads from
+  struct list_head node;            ///< Entry in \see driver_data.readers
+  struct silenar_cursor * cursor;   ///< Read index and overrun count
+  u32 watermark;      ///< Events needed for poll to report the device readable
+  u32 overrun_ack;    ///< Overrun count last acknowledged by the reader
+  int mode;           ///< SILENAR_MODE_EVENTS or SILENAR_MODE_HISTOGRAM
+  spinlock_t histo_lock;  ///< Protects the producer against the swap
+  u64 * histo_live;       ///< Histogram filled by the producer
+  u64 * histo_spare;      ///< Zeroed histogram swapped in by the snapshot
+  u64 * histo;            ///< Last snapshot, mapped read only to userspace
+  bool histo_restart;     ///< The next snapshot starts counting from zero
+  int format;         ///< Format of the events returned by read()
+  u64 last_ns;        ///< Timestamp the next packed record is relative to
+  void * bounce;      ///< Page used to convert the events to \a format
 };
 
+static struct driver_data ddatas[ADC_MAX];  ///< One for each minor
+
+//! CLOCK_REALTIME minus CLOCK_MONOTONIC when the module was loaded, in ns.
+//! Shared by the minors, so the legacy timestamps of coincident events match
+static u64 real_offset;
+
 static dev_t device = 0;
 
 static int cdev_flag = 0;	///< Indicates whether \see cdev has been initialized
 static struct cdev cdev;	
 static struct class * dev_class = NULL; 
-static struct device * dev_device = NULL;
+static struct device * dev_devices[ADC_MAX];
+static struct dentry * debugfs_root = NULL;
 
 
 
-static struct gpio gpios [] = {
+static struct silenar_pin gpio_table [PIN_NUM] = {
   // GPIO table
-  // GPIO, DIRECTION, NAME
-  { 4,  GPIOF_IN, "D00" }, // ADC parallel data bus pins 0 ->
-  { 5,  GPIOF_IN, "D01" },
-  { 6,  GPIOF_IN, "D02" },
-  { 7,  GPIOF_IN, "D03" },
-  { 8,  GPIOF_IN, "D04" },
-  { 9,  GPIOF_IN, "D05" },
-  { 10, GPIOF_IN, "D06" },
-  { 11, GPIOF_IN, "D07" },
-  { 12, GPIOF_IN, "D08" },
-  { 13, GPIOF_IN, "D09" },
-  { 16, GPIOF_IN, "D10" },
-  { 18, GPIOF_IN, "D11" },
-  { 19, GPIOF_IN, "D12" }, // <- to 12
-  { 23, GPIOF_OUT_INIT_LOW, "RUN" }, // Raspberry PI DAQ active
-  { 24, GPIOF_OUT_INIT_LOW, "ENB" },
-  { 25, GPIOF_IN, "LVE" },           // Dead time of silena
-  { 26, GPIOF_IN, "RDY" },           // Silena data ready
-  { 27, GPIOF_OUT_INIT_LOW, "ACK" }  // Raspberry PI data received
+  // GPIO, OUTPUT, NAME
+  { 4,  false, "D00" }, // ADC parallel data bus pins 0 ->
+  { 5,  false, "D01" },
+  { 6,  false, "D02" },
+  { 7,  false, "D03" },
+  { 8,  false, "D04" },
+  { 9,  false, "D05" },
+  { 10, false, "D06" },
+  { 11, false, "D07" },
+  { 12, false, "D08" },
+  { 13, false, "D09" },
+  { 16, false, "D10" },
+  { 18, false, "D11" },
+  { 19, false, "D12" }, // <- to 12
+  { 23, true,  "RUN" }, // Raspberry PI DAQ active
+  { 24, true,  "ENB" },
+  { 25, false, "LVE" }, // Dead time of silena
+  { 26, false, "RDY" }, // Silena data ready
+  { 27, true,  "ACK" }  // Raspberry PI data received
 };
 
 static int debug = 0;   ///< Boolean variable, enables debug messages
 
+static int adcs = 1;        ///< Number of ADCs, each one gets a minor device
+
+// The first ADC is /dev/silenar, the next ones /dev/silenar1, /dev/silenar2...
+// Every ADC has its own GPIOs, interrupts, ring and statistics
+module_param(adcs, int, S_IRUGO);
+
+static int pins[PIN_NUM * ADC_MAX]; ///< GPIO numbers overriding the table
+static int npins = 0;       ///< Number of entries of \see pins
+
+// Replaces the GPIO numbers of the table, in the same order: D00 to D12, RUN,
+// ENB, LVE, RDY and ACK. It allows to run the driver on other boards, or on
+// the lines of a gpio-sim chip to measure the readout without the Silena:
+// gpio_sim.sh creates the chip and readout_bench drives it.
+// With several ADCs the tables of the next ones follow, in the same order
+module_param_array(pins, int, &npins, S_IRUGO);
+
 // This macro creates a file in /sys/module/<name>/parameters/<par> that
 // controls the \see debug variable of type int with permisions 0644
 module_param(debug, int, S_IRUGO | S_IWUSR);
 
-DECLARE_WAIT_QUEUE_HEAD(queue);
+static int ring_events = 16384; ///< Depth of the ring, in events
+static int ring_mib = 0;        ///< Depth of the ring in MiB, if not zero
+
+// The depth of the ring is rounded up to a power of two and takes effect the
+// next time the device is opened by its first reader
+module_param(ring_events, int, S_IRUGO | S_IWUSR);
+module_param(ring_mib, int, S_IRUGO | S_IWUSR);
+
+static int wake_usec = 1000;  ///< Maximum latency of batched wakeups, in us
+
+// The readers are woken as soon as one of them has watermark events to
+// consume, otherwise at most wake_usec after the first event stored since the
+// last wakeup. With wake_usec set to 0 the readers are woken on every event
+module_param(wake_usec, int, S_IRUGO | S_IWUSR);
+
+static int poll_rate = 0;     ///< Interrupts/s that switch to polling, 0 never
+static int poll_idle_usec = 1000; ///< Idle time that switches back, in us
+static int poll_cpu = -1;     ///< CPU of the polling thread, -1 for any
+
+// Above poll_rate conversions/s the RDY interrupt is masked and a kernel
+// thread, pinned to poll_cpu, drains the conversions by polling the line.
+// It switches back to interrupts after poll_idle_usec without conversions.
+// poll_cpu is applied when the device is opened by its first reader
+module_param(poll_rate, int, S_IRUGO | S_IWUSR);
+module_param(poll_idle_usec, int, S_IRUGO | S_IWUSR);
+module_param(poll_cpu, int, S_IRUGO | S_IWUSR);
+
+static int lve_dead = 1;  ///< Level of the LVE line while the Silena is dead
+
+// The Silena holds LVE at this level from the start of a conversion until it
+// is ready for the next one. Set it to 0 if the line is inverted
+module_param(lve_dead, int, S_IRUGO | S_IWUSR);
+
+static int sim_rate = 0;        ///< Events/s of the simulated ADC, 0 disables it
+static int sim_peaks[SIM_PEAKS_MAX] = { 1800, 4700 }; ///< Peak channels
+static int sim_npeaks = 2;      ///< Number of entries of \see sim_peaks
+static int sim_sigma = 60;      ///< Standard deviation of the peaks, channels
+static int sim_background = 30; ///< Percentage of background events
+static int sim_slope = 1500;    ///< Mean channel of the background
+
+// With sim_rate set, the first open does not touch the GPIOs: an hrtimer fills
+// the ring with events arriving as a Poisson process. Their values follow
+// gaussian peaks on top of an exponentially falling background
+module_param(sim_rate, int, S_IRUGO | S_IWUSR);
+module_param_array(sim_peaks, int, &sim_npeaks, S_IRUGO | S_IWUSR);
+module_param(sim_sigma, int, S_IRUGO | S_IWUSR);
+module_param(sim_background, int, S_IRUGO | S_IWUSR);
+module_param(sim_slope, int, S_IRUGO | S_IWUSR);
 
 
 //! \brief Exit function of the kernel module
 //!
 static void silenar_exit(void) {
+  int j;
+  
   DEBUG_ALERT("Exiting the module.");
+  debugfs_remove_recursive(debugfs_root);
+  debugfs_root = NULL;
    // 1. Rimuove FILE in /dev
-   if (dev_device) {
-     device_destroy (dev_class, device);
+   for (j = 0; j < ADC_MAX; ++j) {
+     if (dev_devices[j]) {
+       device_destroy (dev_class, device + j);
+       dev_devices[j] = NULL;
+     }
    }  
   // 2. Distruzione della classe di device
   if (dev_class) {
@@ -128,218 +344,1124 @@ static void silenar_exit(void) {
   }
   // 4. Deallocazione delle risorse del nostro char device
   if (device) {
-    unregister_chrdev_region(device, DEV_NUM);  
+    unregister_chrdev_region(device, adcs);  
+  }
+  // 5. Deallocazione dei buffer circolari
+  for (j = 0; j < ADC_MAX; ++j) {
+    ring_free(&ddatas[j].ring);
   }
 }
 
-//! \brief
+//! \brief Allocates the circular data buffer
 //!
+//! The depth is taken from the ring_mib or ring_events module parameters, the
+//! current buffer is kept when its depth does not change. Only called while
+//! no reader is using the ring.
 //! \param ddata is a pointer to the char device private data
-int read_event(struct driver_data * ddata) {
-  struct timespec64 tim;   // Timestamp of the event
-  int write_idx, val, j;
+static int ring_alloc(struct driver_data * ddata) {
+  unsigned long events;
   
-  ktime_get_real_ts64(&tim);	// New method for gettimeofday
+  events = ring_mib > 0 ? ((unsigned long) ring_mib << 20) / EVENTS_SIZE
+                        : (unsigned long) max(ring_events, 1);
+  events = roundup_pow_of_two(clamp_val(events, RING_MIN, RING_MAX));
+  if (ring_init(&ddata->ring, events)) {
+    DEBUG_ALERT("Unable to allocate a ring of %lu events", events);
+    return -ENOMEM;
+  }
+  return 0;
+}
+
+//! \brief Wakes the readers and records the size of the batch of events
+//! they received in the statistics. Called with \see driver_data.stats_lock
+//! held
+//! \param ddata is a pointer to the char device private data
+static void readers_wake(struct driver_data * ddata) {
+  struct silenar_stats * stats = &ddata->stats;
+  
+  trace_silenar_wake(ddata->minor, ddata->since_wake);
+  ddata->wake_ns = ktime_get_ns();
+  if (ddata->since_wake) {
+    ++stats->wakeups;
+    ++stats->batch_hist[min(ilog2(ddata->since_wake),
+                            SILENAR_BATCH_BINS - 1)];
+    ddata->since_wake = 0;
+  }
+  wake_up(&ddata->queue);
+}
+
+//! \brief Counts a latency in one of the log2 binned latency histograms.
+//! Called with \see driver_data.stats_lock held
+//! \param hist is the histogram, LAT_BINS counters
+//! \param ns is the latency, in ns
+static void lat_hist_add(u64 * hist, u64 ns) {
+  ++hist[min_t(u32, ns ? ilog2(ns) : 0, LAT_BINS - 1)];
+}
 
-  //do_gettimeofday(&tim); // Wrapper for gettimeofday in kernel space
+//! \brief Callback of the wakeup timer, wakes the readers whose events
+//! waited for the maximum latency
+//! \param timer is a pointer to \see driver_data.wake_timer
+static enum hrtimer_restart wake_timer_expired(struct hrtimer * timer) {
+  struct driver_data * ddata =
+      container_of(timer, struct driver_data, wake_timer);
+  unsigned long flags;
+  
+  spin_lock_irqsave(&ddata->stats_lock, flags);
+  WRITE_ONCE(ddata->timer_armed, 0);
+  readers_wake(ddata);
+  spin_unlock_irqrestore(&ddata->stats_lock, flags);
+  return HRTIMER_NORESTART;
+}
 
-  write_idx = atomic_read(&(ddata->write_idx));
+//! \brief Fills the histograms of the readers in histogram mode and updates
+//! the ring statistics after the event of index write_idx was stored,
+//! comparing the write index with the cursor of the slowest reader. Then
+//! wakes the readers if one of them reached its watermark, or arms the
+//! wakeup timer
+//!
+//! \param ddata is a pointer to the char device private data
+//! \param write_idx is the index of the event just stored
+//! \param readout is the time spent reading the event from the bus, in ns
+//! \param ack is the time between the RDY interrupt and the ACK, in ns
+static void readers_update(struct driver_data * ddata, u32 write_idx,
+                           u64 readout, u64 ack) {
+  struct silenar_stats * stats = &ddata->stats;
+  struct silenar_event * event = ring_slot(&ddata->ring, write_idx);
+  struct reader_data * reader;
+  unsigned long flags;
+  u32 backlog = 0, count;
+  u32 value = event->value;
+  u64 now = event->ts_ns;
+  int latency = READ_ONCE(wake_usec);
+  bool ready = latency <= 0;
   
-  if ( ((write_idx + 1) % SIZE) == atomic_read(&(ddata->read_idx)) ) {
-    //DEBUG_ALERT("Strange things are happening");
-    ddata->fHang = 1;
-    return -1;
+  rcu_read_lock();
+  list_for_each_entry_rcu(reader, &ddata->readers, node) {
+    if (smp_load_acquire(&reader->mode) == SILENAR_MODE_HISTOGRAM) {
+      spin_lock_irqsave(&reader->histo_lock, flags);
+      ++reader->histo_live[value % SILENAR_HISTO_BINS];
+      spin_unlock_irqrestore(&reader->histo_lock, flags);
+      continue;
+    }
+    // The cursor is written by userspace, a bogus index must not make up
+    // drops or wakeups for the other readers
+    count = ring_backlog(&ddata->ring, write_idx + 1,
+                         READ_ONCE(reader->cursor->read_idx));
+    backlog = max(backlog, count);
+    ready |= count >= READ_ONCE(reader->watermark);
   }
+  rcu_read_unlock();
   
-  val = 0;
-  for (j = 12; j >= 0; --j) {
-    val = (val << 1) | gpio_get_value(gpios[j].gpio);
+  // The producer runs in the IRQ thread with interrupts enabled, and the
+  // wakeup timer takes the same lock in hard interrupt context
+  spin_lock_irqsave(&ddata->stats_lock, flags);
+  ++stats->events;
+  stats->readout_ns += readout;
+  stats->readout_max_ns = max_t(u32, stats->readout_max_ns, readout);
+  stats->ack_ns += ack;
+  stats->ack_max_ns = max_t(u32, stats->ack_max_ns, ack);
+  if (backlog > ddata->ring.size) {
+    // The event overwrote one the slowest reader did not consume
+    ++stats->dropped;
+    trace_silenar_ring_full(ddata->minor, write_idx, ddata->ring.size);
+    backlog = ddata->ring.size;
+  }
+  stats->high_water = max(stats->high_water, backlog);
+  if (backlog == ddata->ring.size) {
+    if (!ddata->full_since) {
+      ddata->full_since = now;
+    }
+  }
+  else if (ddata->full_since) {
+    stats->full_ns += now - ddata->full_since;
+    ddata->full_since = 0;
   }
-  val ^= 0x1FFF;
   
-  gpio_set_value(GPIO_ACK, 1);
-  ddata->events[write_idx].tv_sec   = (int32_t)(tim.tv_sec);
-  ddata->events[write_idx].tv_usec  = (int32_t)(tim.tv_nsec / 1000);
-  ddata->events[write_idx].value    = val;
-  write_idx = (write_idx + 1) % SIZE;
-  atomic_set(&(ddata->write_idx), write_idx);
+  ++ddata->since_wake;
+  if (ready) {
+    readers_wake(ddata);
+  }
+  else if (!ddata->timer_armed) {
+    WRITE_ONCE(ddata->timer_armed, 1);
+    hrtimer_start(&ddata->wake_timer, ns_to_ktime(latency * NSEC_PER_USEC),
+                  HRTIMER_MODE_REL);
+  }
+  spin_unlock_irqrestore(&ddata->stats_lock, flags);
+}
+
+//! \brief Returns the number of events the reader can still consume
+//!
+//! The read index is written by userspace through the mapping, so it is never
+//! trusted to be consistent with the write index.
+//! \param reader is a pointer to the open file private data
+static u32 reader_count(struct reader_data * reader) {
+  return ring_available(&reader->ddata->ring,
+                        READ_ONCE(reader->cursor->read_idx));
+}
+
+//! \brief Returns true if the reader should be woken: it has at least
+//! watermark events to consume, or fewer but the wakeup latency expired
+//!
+//! Every event stored while \see driver_data.wake_timer is idle arms it, so
+//! pending events with an idle timer have already waited long enough.
+//! \param reader is a pointer to the open file private data
+static bool reader_ready(struct reader_data * reader) {
+  u32 count = reader_count(reader);
+  return count >= READ_ONCE(reader->watermark) ||
+      (count && !READ_ONCE(reader->ddata->timer_armed));
+}
+
+//! \brief Returns true if the producer overwrote events the reader did not
+//! consume yet
+//! \param reader is a pointer to the open file private data
+static bool reader_overrun(struct reader_data * reader) {
+  struct silenar_ring * ring = &reader->ddata->ring;
+  // A cursor written ahead of the producer did not lose any event
+  return ring_backlog(ring, ring_head(ring),
+                      READ_ONCE(reader->cursor->read_idx)) >= ring->size;
+}
+
+//! \brief Applies the lower and upper level discriminator to an ADC value,
+//! then drops its least significant bits if rebinning is enabled
+//!
+//! Rejected events are counted in the ring statistics and never stored.
+//! \param ddata is a pointer to the char device private data
+//! \param value is the ADC value, replaced by the rebinned value
+//! \return true if the event is accepted
+static bool discriminate(struct driver_data * ddata, u32 * value) {
+  u32 discr = READ_ONCE(ddata->discr);
+  unsigned long flags;
+  
+  if (DISCR_LLD(discr) <= *value && *value <= DISCR_ULD(discr)) {
+    *value >>= DISCR_REBIN(discr);
+    return true;
+  }
+  spin_lock_irqsave(&ddata->stats_lock, flags);
+  if (*value < DISCR_LLD(discr)) {
+    ++ddata->stats.below_lld;
+  }
+  else {
+    ++ddata->stats.above_uld;
+  }
+  spin_unlock_irqrestore(&ddata->stats_lock, flags);
+  return false;
+}
+
+//! \brief Reads the ADC data bus and stores the event in the ring
+//!
+//! Runs in the IRQ thread, the GPIO accesses may sleep. The conversion is
+//! always acknowledged, so the ADC never stalls.
+//! \param ddata is a pointer to the char device private data
+//! \param ns is the timestamp of the event, taken by the hard handler
+//! \return 0 if the event was stored, 1 if the discriminator rejected it
+int read_event(struct driver_data * ddata, u64 ns) {
+  DECLARE_BITMAP(bus, BUS_WIDTH);
+  u64 start, ack, readout;
+  u32 write_idx = 0, val;
+  bool accepted;
+  
+  start = ktime_get_ns();
+  
+  // Sample the whole data bus at once, the lines of one chip are read with a
+  // single register access. D00 ends up in the least significant bit
+  if (gpiod_get_raw_array_value_cansleep(BUS_WIDTH, ddata->bus, NULL, bus)) {
+    DEBUG_ALERT("Unable to read the data bus");
+  }
+  val = (bus[0] & 0x1FFF) ^ 0x1FFF;
+  accepted = discriminate(ddata, &val);
   
-  gpio_set_value(GPIO_ACK, 0);
+  gpiod_set_raw_value_cansleep(ddata->ack, 1);
+  ack = ktime_get_ns();
+  if (accepted) {
+    write_idx = ring_push(&ddata->ring, ns, val);
+  }
+  gpiod_set_raw_value_cansleep(ddata->ack, 0);
+  readout = ktime_get_ns() - start;
+  trace_silenar_readout(ddata->minor, val, accepted, readout, ack - ns);
+  
+  if (!accepted) {
+    return 1;
+  }
+  readers_update(ddata, write_idx, readout, ack - ns);
   return 0;
 }
 
-//! \brief Callback function of the Silena RDY interrupt
+//! \brief Switches from interrupts to polling if the rate of the RDY
+//! interrupt exceeds poll_rate. Called by the IRQ thread
+//! \param ddata is a pointer to the char device private data
+//! \param ns is the time of the interrupt
+static void poll_check(struct driver_data * ddata, u64 ns) {
+  struct silenar_stats * stats = &ddata->stats;
+  int rate = READ_ONCE(poll_rate);
+  unsigned long flags;
+  u64 window = ns - ddata->rate_since;
+  
+  ++ddata->rate_events;
+  if (window < RATE_WINDOW_NS) {
+    return;
+  }
+  if (rate <= 0 || !ddata->poll_task ||
+      (u64) ddata->rate_events * NSEC_PER_SEC < (u64) rate * window) {
+    ddata->rate_since  = ns;
+    ddata->rate_events = 0;
+    return;
+  }
+  // The thread handler of the same interrupt cannot wait for itself
+  disable_irq_nosync(ddata->rdyirq);
+  spin_lock_irqsave(&ddata->stats_lock, flags);
+  stats->irq_mode_ns += ns - ddata->mode_since;
+  ++stats->poll_entries;
+  ddata->mode_since = ns;
+  WRITE_ONCE(ddata->polling, true);
+  spin_unlock_irqrestore(&ddata->stats_lock, flags);
+  wake_up_process(ddata->poll_task);
+}
+
+//! \brief Polling thread, drains the conversions of the Silena while the RDY
+//! interrupt is masked, like NAPI does for network cards
 //!
+//! Each conversion is read as soon as RDY goes low, then the thread waits for
+//! RDY to rise after the ACK. After poll_idle_usec without conversions, or
+//! with RDY stuck low, the interrupt is unmasked and the thread sleeps until
+//! the next switch.
+//! \param arg is a pointer to the char device private data
+static int poll_thread(void * arg) {
+  struct driver_data * ddata = arg;
+  struct silenar_stats * stats = &ddata->stats;
+  unsigned long flags;
+  u64 now, since, events;
+  bool low, armed;
+  int spins;
+  
+  while (!kthread_should_stop()) {
+    set_current_state(TASK_INTERRUPTIBLE);
+    // Checked again after the state change, not to miss the wakeup
+    if (kthread_should_stop()) {
+      break;
+    }
+    if (!READ_ONCE(ddata->polling)) {
+      schedule();
+      continue;
+    }
+    __set_current_state(TASK_RUNNING);
+    
+    // The last conversion was acknowledged by the IRQ thread, RDY must rise
+    // before the next one can be read
+    armed  = false;
+    since  = ktime_get_ns();
+    events = 0;
+    for (spins = 1; !kthread_should_stop(); ++spins) {
+      low = !gpiod_get_raw_value_cansleep(ddata->rdy);
+      now = ktime_get_ns();
+      if (low && armed) {
+        read_event(ddata, now);
+        ++events;
+        armed = false;
+        since = now;
+      }
+      else if (!low && !armed) {
+        armed = true;
+        since = now;
+      }
+      else if (now - since > READ_ONCE(poll_idle_usec) * NSEC_PER_USEC) {
+        break;
+      }
+      if (spins % POLL_BUDGET == 0) {
+        cond_resched();
+      }
+    }
+    
+    // Back to interrupts, a conversion that arrived meanwhile is replayed
+    spin_lock_irqsave(&ddata->stats_lock, flags);
+    now = ktime_get_ns();
+    stats->poll_mode_ns += now - ddata->mode_since;
+    stats->poll_events  += events;
+    ddata->mode_since  = now;
+    ddata->rate_since  = now;
+    ddata->rate_events = 0;
+    WRITE_ONCE(ddata->polling, false);
+    spin_unlock_irqrestore(&ddata->stats_lock, flags);
+    enable_irq(ddata->rdyirq);
+  }
+  // Stopped right after a switch, before the thread could poll
+  if (READ_ONCE(ddata->polling)) {
+    WRITE_ONCE(ddata->polling, false);
+    enable_irq(ddata->rdyirq);
+  }
+  __set_current_state(TASK_RUNNING);
+  return 0;
+}
+
+//! \brief Hard handler of the Silena RDY interrupt, only timestamps the
+//! event and leaves the readout to \see irq_thread
+//!
+//! The line stays masked until the thread returns (IRQF_ONESHOT), and the
+//! Silena holds the next conversion until the ACK, so a single timestamp is
+//! in flight.
 //! \param irq is the code of the IRQ line
 //! \param arg is a pointer to the char device private data
 irqreturn_t irq_service (int irq, void * arg) {
   struct driver_data * ddata = arg;
   
+  ddata->irq_ns = ktime_get_ns();	// Monotonic, immune to clock adjustments
+  trace_silenar_irq(ddata->minor, ddata->irq_ns);
   if (irq != ddata->rdyirq) {
     DEBUG_ALERT("Interrupt received is not RDY IRQ");
     return IRQ_HANDLED;
   }
-  if (gpio_get_value(GPIO_RDY) == 1) {
+  return IRQ_WAKE_THREAD;
+}
+
+//! \brief Threaded handler of the Silena RDY interrupt, reads the event
+//! timestamped by \see irq_service
+//!
+//! \param irq is the code of the IRQ line
+//! \param arg is a pointer to the char device private data
+irqreturn_t irq_thread (int irq, void * arg) {
+  struct driver_data * ddata = arg;
+  unsigned long flags;
+  
+  // An edge latched while polling is replayed when the interrupt is
+  // unmasked, the polling thread may have read that conversion already
+  if (gpiod_get_raw_value_cansleep(ddata->rdy)) {
     return IRQ_HANDLED;
   }
-  if (ddata->fHang) {
-    ddata->fDone = 1;
-    wake_up(&queue);
-    return IRQ_HANDLED;
+  read_event(ddata, ddata->irq_ns);
+  
+  spin_lock_irqsave(&ddata->stats_lock, flags);
+  lat_hist_add(ddata->irq_hist, ktime_get_ns() - ddata->irq_ns);
+  spin_unlock_irqrestore(&ddata->stats_lock, flags);
+  
+  poll_check(ddata, ddata->irq_ns);
+  return IRQ_HANDLED;
+}
+
+//! \brief Threaded handler of the Silena LVE interrupt, accumulates the dead
+//! time of the run and counts the conversions
+//!
+//! The level of LVE is read with the sleeping accessor, the line may belong
+//! to a chip that sleeps like gpio-sim. The edges that occur while the
+//! handler runs are masked, the level read next sets the state right.
+//! \param irq is the code of the IRQ line
+//! \param arg is a pointer to the char device private data
+irqreturn_t lve_service (int irq, void * arg) {
+  struct driver_data * ddata = arg;
+  struct silenar_livetime * livetime = &ddata->livetime;
+  u64 now = ktime_get_ns();
+  bool dead = gpiod_get_raw_value_cansleep(ddata->lve) ==
+      !!READ_ONCE(lve_dead);
+  unsigned long flags;
+  
+  spin_lock_irqsave(&ddata->stats_lock, flags);
+  if (ddata->running) {
+    if (dead && !ddata->dead_since) {
+      ddata->dead_since = now;
+      ++livetime->conversions;
+    }
+    else if (!dead && ddata->dead_since) {
+      livetime->dead_ns += now - ddata->dead_since;
+      ddata->dead_since = 0;
+    }
   }
-  if (read_event(ddata)) {
-    // In case the read failed, the queue is not awoken
-    return IRQ_HANDLED;
+  spin_unlock_irqrestore(&ddata->stats_lock, flags);
+  return IRQ_HANDLED;
+}
+
+
+//! \brief Returns -ln(u / 2^32) in Q16 fixed point, for u in (0, 2^32)
+//!
+//! The kernel has no floating point: log2(u) is computed bit by bit by
+//! repeated squaring of the normalized mantissa.
+//! \param u is a uniformly distributed random number, not zero
+static u32 sim_neglog(u32 u) {
+  int e = fls(u) - 1;
+  u64 m = (u64) u << (31 - e);  // Mantissa in [1, 2), Q31
+  u32 frac = 0;
+  int j;
+  
+  for (j = 0; j < 16; ++j) {
+    m = (m * m) >> 31;
+    frac <<= 1;
+    if (m >> 32) {
+      m >>= 1;
+      frac |= 1;
+    }
   }
+  // -ln(u / 2^32) = (32 - log2(u)) * ln(2), ln(2) = 45426 in Q16
+  return ((u64) ((32 << 16) - ((e << 16) | frac)) * 45426) >> 16;
+}
+
+//! \brief Returns the ADC value of a simulated event
+//! \param ddata is a pointer to the char device private data
+static u32 sim_value(struct driver_data * ddata) {
+  struct rnd_state * rnd = &ddata->sim_rnd;
+  int npeaks = min(READ_ONCE(sim_npeaks), SIM_PEAKS_MAX);
+  s64 z;
+  u32 r;
+  int j;
   
-  ddata->fDone = 1;
-  wake_up(&queue);
-  return IRQ_HANDLED;
+  if (npeaks <= 0 || prandom_u32_state(rnd) % 100 <
+      (u32) READ_ONCE(sim_background)) {
+    // Exponential background
+    return (((u64) READ_ONCE(sim_slope) *
+             sim_neglog(prandom_u32_state(rnd) | 1)) >> 16) &
+        (SILENAR_HISTO_BINS - 1);
+  }
+  // Gaussian peak: the sum of 12 uniform numbers in [0, 1), minus 6, has
+  // zero mean and unit variance
+  z = -(6 << 16);
+  for (j = 0; j < 6; ++j) {
+    r = prandom_u32_state(rnd);
+    z += (r >> 16) + (r & 0xFFFF);
+  }
+  z = sim_peaks[prandom_u32_state(rnd) % npeaks] +
+      ((z * READ_ONCE(sim_sigma)) >> 16);
+  return clamp_val(z, 0, SILENAR_HISTO_BINS - 1);
+}
+
+//! \brief Callback of the simulated ADC timer, stores the events arrived
+//! since the previous tick
+//!
+//! The arrival times are spaced by exponentially distributed intervals, so
+//! the events follow a Poisson process of rate sim_rate. The timer runs in
+//! softirq context and stores at most SIM_BURST_MAX events per expiry: at
+//! higher rates it expires every SIM_CATCH_UP_NS until it caught up.
+//! \param timer is a pointer to \see driver_data.sim_timer
+static enum hrtimer_restart sim_tick(struct hrtimer * timer) {
+  struct driver_data * ddata =
+      container_of(timer, struct driver_data, sim_timer);
+  u64 now  = ktime_get_ns();
+  u64 mean = NSEC_PER_SEC / max(READ_ONCE(sim_rate), 1);
+  unsigned long flags;
+  u32 write_idx, val;
+  int burst;
+  
+  for (burst = 0; ddata->sim_next <= now && burst < SIM_BURST_MAX; ++burst) {
+    val = sim_value(ddata);
+    if (discriminate(ddata, &val)) {
+      write_idx = ring_push(&ddata->ring, ddata->sim_next, val);
+      readers_update(ddata, write_idx, 0, 0);
+    }
+    ddata->sim_next +=
+        (mean * sim_neglog(prandom_u32_state(&ddata->sim_rnd) | 1)) >> 16;
+  }
+  
+  // The simulated ADC has no dead time, every event is a conversion. The
+  // wakeup timer takes the same lock in hard interrupt context
+  spin_lock_irqsave(&ddata->stats_lock, flags);
+  ddata->livetime.conversions += burst;
+  spin_unlock_irqrestore(&ddata->stats_lock, flags);
+  
+  if (ddata->sim_next > now) {
+    hrtimer_forward_now(timer, ns_to_ktime(SIM_TICK_NS));
+    return HRTIMER_RESTART;
+  }
+  if (now - ddata->sim_next > SIM_LAG_MAX_NS) {
+    // Too far behind, the rate cannot be sustained: give up on the late
+    // events rather than falling further behind
+    ddata->sim_next = now;
+  }
+  hrtimer_forward_now(timer, ns_to_ktime(SIM_CATCH_UP_NS));
+  return HRTIMER_RESTART;
 }
 
+//! \brief Starts or stops the live time accounting of a run. Starting a
+//! run that is already running does nothing
+//! \param ddata is a pointer to the char device private data
+//! \param run is true to start the run
+//! \param dead is true if the Silena is dead when the run starts
+static void livetime_run(struct driver_data * ddata, bool run, bool dead) {
+  struct silenar_livetime * livetime = &ddata->livetime;
+  u64 now = ktime_get_ns();
+  unsigned long flags;
+  
+  spin_lock_irqsave(&ddata->stats_lock, flags);
+  if (run && !ddata->running) {
+    memset(livetime, 0, sizeof (*livetime));
+    ddata->run_start  = now;
+    ddata->run_events = ddata->stats.events;
+    ddata->dead_since = dead ? now : 0;
+  }
+  else if (!run && ddata->running) {
+    livetime->real_ns  = now - ddata->run_start;
+    livetime->accepted = ddata->stats.events - ddata->run_events;
+    if (ddata->dead_since) {
+      livetime->dead_ns += now - ddata->dead_since;
+      ddata->dead_since = 0;
+    }
+  }
+  ddata->running = run;
+  spin_unlock_irqrestore(&ddata->stats_lock, flags);
+}
 
-//! \brief
-//! \param node
-//! \param filep
-static int open (struct inode * node, struct file * filep) {
-//  MAJOR(node->i_rdev)
-//  MINOR(node->i_rdev)
-  static struct driver_data ddata;
-  int status;
+//! \brief Starts or stops the acquisition, on the Silena or the simulated ADC
+//! \param ddata is a pointer to the char device private data
+//! \param run is true to start the acquisition
+static void acquisition_run(struct driver_data * ddata, bool run) {
+  if (!ddata->simulated) {
+    // Called in process context only, the lines may sleep
+    gpiod_set_raw_value_cansleep(ddata->run, run);
+    gpiod_set_raw_value_cansleep(ddata->enb, run);
+    livetime_run(ddata, run, gpiod_get_raw_value_cansleep(ddata->lve) ==
+                 !!READ_ONCE(lve_dead));
+    return;
+  }
+  livetime_run(ddata, run, false);
+  if (!run) {
+    hrtimer_cancel(&ddata->sim_timer);
+  }
+  else if (!hrtimer_active(&ddata->sim_timer)) {
+    ddata->sim_next = ktime_get_ns();
+    hrtimer_start(&ddata->sim_timer, ns_to_ktime(SIM_TICK_NS),
+                  HRTIMER_MODE_REL_SOFT);
+  }
+}
+
+//! \brief Takes a snapshot of the histogram of the reader
+//!
+//! The live histogram is swapped with the zeroed spare one in a single step,
+//! so every event is counted by exactly one snapshot. Called with
+//! \see driver_data.lock held.
+//! \param reader is a pointer to the open file private data
+//! \param clear makes the next snapshot start counting from zero
+static void histo_snapshot(struct reader_data * reader, bool clear) {
+  unsigned long flags;
+  u64 * frozen;
+  int j;
   
-  DEBUG_ALERT("Opened the file.");
+  spin_lock_irqsave(&reader->histo_lock, flags);
+  frozen = reader->histo_live;
+  reader->histo_live  = reader->histo_spare;
+  reader->histo_spare = frozen;
+  spin_unlock_irqrestore(&reader->histo_lock, flags);
+  
+  // The producer no longer touches the frozen histogram
+  for (j = 0; j < SILENAR_HISTO_BINS; ++j) {
+    reader->histo[j] = (reader->histo_restart ? 0 : reader->histo[j]) +
+        frozen[j];
+    frozen[j] = 0;
+  }
+  reader->histo_restart = clear;
+}
+
+//! \brief Switches the reader between the event and the histogram mode.
+//! Called with \see driver_data.lock held
+//!
+//! The histogram is kept when leaving the histogram mode, a reader coming
+//! back to the event mode starts from the current write index.
+//! \param reader is a pointer to the open file private data
+//! \param mode is SILENAR_MODE_EVENTS or SILENAR_MODE_HISTOGRAM
+static int reader_set_mode(struct reader_data * reader, unsigned long mode) {
+  switch (mode) {
+  case SILENAR_MODE_EVENTS:
+    WRITE_ONCE(reader->cursor->read_idx,
+               ring_head(&reader->ddata->ring));
+    break;
+  case SILENAR_MODE_HISTOGRAM:
+    if (!reader->histo) {
+      reader->histo_live  = vzalloc(HISTO_BYTES);
+      reader->histo_spare = vzalloc(HISTO_BYTES);
+      reader->histo       = vmalloc_user(HISTO_BYTES);
+      if (!reader->histo_live || !reader->histo_spare || !reader->histo) {
+        vfree(reader->histo_live);
+        vfree(reader->histo_spare);
+        vfree(reader->histo);
+        reader->histo = NULL;
+        return -ENOMEM;
+      }
+    }
+    break;
+  default:
+    return -EINVAL;
+  }
+  // The histograms must be visible before the producer sees the mode
+  smp_store_release(&reader->mode, mode);
+  return 0;
+}
+
+//! \brief Requests the lines of the GPIO table of an ADC, the outputs start
+//! low. The lines are given by their global number, the only request that
+//! takes one is gpio_request(): everything else goes through descriptors
+//! \param ddata is a pointer to the char device private data
+//! \return 0 on success, a negative error code otherwise
+static int gpios_request(struct driver_data * ddata) {
+  struct silenar_pin const * pin;
+  struct gpio_desc * desc;
+  int status, j;
   
-  filep->private_data = &ddata;
-  atomic_set(&(ddata.write_idx), 0);
-  atomic_set(&(ddata.read_idx), 0);
+  for (j = 0; j < PIN_NUM; ++j) {
+    pin = &ddata->gpios[j];
+    status = gpio_request(pin->gpio, pin->label);
+    if (status) {
+      goto failure;
+    }
+    desc = gpio_to_desc(pin->gpio);
+    status = pin->output ? gpiod_direction_output_raw(desc, 0)
+                         : gpiod_direction_input(desc);
+    if (status) {
+      gpio_free(pin->gpio);
+      goto failure;
+    }
+  }
+  return 0;
+  
+  failure:
+    while (j--) {
+      gpio_free(ddata->gpios[j].gpio);
+    }
+    return status;
+}
+
+//! \brief Releases the lines requested by \see gpios_request
+//! \param ddata is a pointer to the char device private data
+static void gpios_free(struct driver_data * ddata) {
+  int j;
+  
+  for (j = 0; j < PIN_NUM; ++j) {
+    gpio_free(ddata->gpios[j].gpio);
+  }
+}
+
+//! \brief Requests the GPIOs and the RDY interrupt and starts the
+//! acquisition. Called with \see driver_data.lock held by the first open
+//! \param ddata is a pointer to the char device private data
+static int acquisition_setup(struct driver_data * ddata) {
+  int status, j;
+  
+  status = ring_alloc(ddata);
+  if (status) {
+    return status;
+  }
+  memset(&ddata->stats, 0, sizeof (ddata->stats));
+  memset(ddata->irq_hist, 0, sizeof (ddata->irq_hist));
+  memset(ddata->wake_hist, 0, sizeof (ddata->wake_hist));
+  ddata->stats.size = ddata->ring.size;
+  ddata->full_since = 0;
+  ddata->since_wake = 0;
+  
+  ddata->simulated = READ_ONCE(sim_rate) > 0;
+  if (ddata->simulated) {
+    DEBUG_ALERT("Starting the simulated ADC at %d events/s", sim_rate);
+    prandom_seed_state(&ddata->sim_rnd, get_random_u32());
+    acquisition_run(ddata, true);
+    return 0;
+  }
   
   // Setup GPIO hardware
-  status = gpio_request_array(gpios, ARRAY_SIZE(gpios));
+  status = gpios_request(ddata);
   if (status) {
     // Gestione dell'errore
     DEBUG_ALERT("Unable to request GPIOs");
     return status;
   }
   
-  gpio_direction_input(GPIO_RDY);
-  ddata.rdyirq = gpio_to_irq(GPIO_RDY); // Il identificatore del interrupt
-  ddata.fHang = 0;
-  ddata.fDone = 1;
+  for (j = 0; j < BUS_WIDTH; ++j) {
+    ddata->bus[j] = gpio_to_desc(ddata->gpios[j].gpio);
+  }
+  ddata->run = gpio_to_desc(ddata->gpios[PIN_RUN].gpio);
+  ddata->enb = gpio_to_desc(ddata->gpios[PIN_ENB].gpio);
+  ddata->ack = gpio_to_desc(ddata->gpios[PIN_ACK].gpio);
+  ddata->lve = gpio_to_desc(ddata->gpios[PIN_LVE].gpio);
+  ddata->rdy = gpio_to_desc(ddata->gpios[PIN_RDY].gpio);
+  
+  ddata->rdyirq = gpiod_to_irq(ddata->rdy); // Il identificatore del interrupt
   
-  if ( request_threaded_irq (ddata.rdyirq, irq_service, NULL, 
-                                IRQF_TRIGGER_FALLING | IRQF_TRIGGER_RISING,
-                                "silenar_irq", &ddata) ) {
+  // RDY is active low: the falling edge announces a conversion, the rising
+  // edge follows the ACK and carries no information
+  status = request_threaded_irq(ddata->rdyirq, irq_service, irq_thread,
+                                IRQF_TRIGGER_FALLING | IRQF_ONESHOT,
+                                "silenar_irq", ddata);
+  if (status) {
     DEBUG_ALERT("Unable to request RDY interrupt");
-    gpio_free_array(gpios, ARRAY_SIZE(gpios));
-    return -1;
+    gpios_free(ddata);
+    return status;
+  }
+  
+  // Both edges of LVE delimit the dead time. The handler reads the line, so
+  // it runs in a thread like the readout of RDY
+  ddata->lveirq = gpiod_to_irq(ddata->lve);
+  status = request_threaded_irq(ddata->lveirq, NULL, lve_service,
+                                IRQF_TRIGGER_FALLING | IRQF_TRIGGER_RISING |
+                                IRQF_ONESHOT, "silenar_lve", ddata);
+  if (status) {
+    DEBUG_ALERT("Unable to request LVE interrupt");
+    free_irq(ddata->rdyirq, ddata);
+    gpios_free(ddata);
+    return status;
+  }
+  
+  // The polling thread sleeps until the rate exceeds poll_rate. Without it
+  // the driver keeps working on interrupts only
+  ddata->polling     = false;
+  ddata->mode_since  = ktime_get_ns();
+  ddata->rate_since  = ddata->mode_since;
+  ddata->rate_events = 0;
+  ddata->poll_task = kthread_create(poll_thread, ddata, "silenar_poll/%d",
+                                    ddata->minor);
+  if (IS_ERR(ddata->poll_task)) {
+    DEBUG_ALERT("Unable to create the polling thread");
+    ddata->poll_task = NULL;
+  }
+  else {
+    if (poll_cpu >= 0 && cpu_online(poll_cpu)) {
+      kthread_bind(ddata->poll_task, poll_cpu);
+    }
+    wake_up_process(ddata->poll_task);
   }
   
-  gpio_set_value(GPIO_RUN,1);
-  gpio_set_value(GPIO_ENB,1);
+  acquisition_run(ddata, true);
   
   return 0;
 }
 
-//! \brief
+//! \brief Stops the acquisition and releases the RDY interrupt and the
+//! GPIOs. Called with \see driver_data.lock held by the last close
+//! \param ddata is a pointer to the char device private data
+static void acquisition_release(struct driver_data * ddata) {
+  acquisition_run(ddata, false);
+  
+  // The polling thread unmasks RDY before it exits
+  if (ddata->poll_task) {
+    kthread_stop(ddata->poll_task);
+    ddata->poll_task = NULL;
+  }
+  
+  // Unregister the RDY and LVE interrupts
+  if (!ddata->simulated) {
+    free_irq(ddata->rdyirq, ddata);
+    free_irq(ddata->lveirq, ddata);
+  }
+  hrtimer_cancel(&ddata->wake_timer);
+  ddata->timer_armed = 0;
+  
+  // Release GPIOs
+  if (!ddata->simulated) {
+    gpios_free(ddata);
+  }
+}
+
+//! \brief Creates a new reader of the ring, the first one also sets up the
+//! hardware
 //! \param node
 //! \param filep
-static int close (struct inode * node, struct file * filp) {
-  struct driver_data * ddata = filp->private_data;
-  DEBUG_ALERT("Closed the file.");
-  
-  gpio_set_value(GPIO_RUN,0);
-  gpio_set_value(GPIO_ENB,0);
+static int open (struct inode * node, struct file * filep) {
+  // Every minor is the char device of one ADC
+  struct driver_data * ddata = &ddatas[iminor(node) - BASE_MINOR];
+  struct reader_data * reader;
+  int status;
   
+  DEBUG_ALERT("Opened the file.");
   
-  // Unregister the RDY interrupt
-  free_irq(ddata->rdyirq, ddata);
+  reader = kzalloc(sizeof (*reader), GFP_KERNEL);
+  if (!reader) {
+    return -ENOMEM;
+  }
+  reader->cursor = (struct silenar_cursor *) get_zeroed_page(GFP_KERNEL);
+  reader->bounce = (void *) __get_free_page(GFP_KERNEL);
+  if (!reader->cursor || !reader->bounce) {
+    free_page((unsigned long) reader->cursor);
+    free_page((unsigned long) reader->bounce);
+    kfree(reader);
+    return -ENOMEM;
+  }
+  reader->ddata     = ddata;
+  reader->watermark = 1;
+  reader->mode      = SILENAR_MODE_EVENTS;
+  reader->format    = SILENAR_FORMAT_LEGACY;
+  spin_lock_init(&reader->histo_lock);
   
-  // Release GPIOs
-  gpio_free_array(gpios, ARRAY_SIZE(gpios));
+  mutex_lock(&ddata->lock);
+  status = ddata->users ? 0 : acquisition_setup(ddata);
+  if (!status) {
+    ++ddata->users;
+    // The reader only sees the events produced after it joined
+    reader->cursor->read_idx = ring_head(&ddata->ring);
+    list_add_tail_rcu(&reader->node, &ddata->readers);
+  }
+  mutex_unlock(&ddata->lock);
   
+  if (status) {
+    free_page((unsigned long) reader->cursor);
+    free_page((unsigned long) reader->bounce);
+    kfree(reader);
+    return status;
+  }
+  filep->private_data = reader;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 12, 0)
+  // read_iter honours IOCB_NOWAIT, io_uring can try reads inline
+  filep->f_mode |= FMODE_NOWAIT;
+#endif
   return 0;
 }
 
-//! \brief
+//! \brief Removes the reader, the last one also releases the hardware
+//! \param node
 //! \param filep
-//! \param buff
-//! \param count
-//! \param ppos
-static ssize_t read
-(struct file * filp, char * buff, size_t count, loff_t *ppos) {
-  struct driver_data * ddata = filp->private_data;
-  struct event * events = ddata->events;
-  int read_idx, write_idx, transfer, transfer_bytes, retval;
+static int close (struct inode * node, struct file * filp) {
+  struct reader_data * reader = filp->private_data;
+  struct driver_data * ddata = reader->ddata;
+  DEBUG_ALERT("Closed the file.");
   
-  int request = count / EVENTS_SIZE;
-  if (request == 0) {
+  mutex_lock(&ddata->lock);
+  list_del_rcu(&reader->node);
+  if (--ddata->users == 0) {
+    acquisition_release(ddata);
+  }
+  mutex_unlock(&ddata->lock);
+  // Wait for the producer to stop looking at the cursor
+  synchronize_rcu();
+  
+  if (reader->histo) {
+    vfree(reader->histo_live);
+    vfree(reader->histo_spare);
+    vfree(reader->histo);
+  }
+  free_page((unsigned long) reader->cursor);
+  free_page((unsigned long) reader->bounce);
+  kfree(reader);
+  return 0;
+}
+
+//! \brief Takes a snapshot of the histogram of the reader and copies it to
+//! the destination, which must hold the whole histogram
+//! \param reader is a pointer to the open file private data
+//! \param to is the destination of the read
+static ssize_t histo_read(struct reader_data * reader, struct iov_iter * to) {
+  struct driver_data * ddata = reader->ddata;
+  size_t copied;
+  
+  if (iov_iter_count(to) < HISTO_BYTES) {
     DEBUG_ALERT("Read request rejected, consult the documentation.");
-    return -1;
+    return -EINVAL;
   }
+  mutex_lock(&ddata->lock);
+  histo_snapshot(reader, false);
+  copied = copy_to_iter(reader->histo, HISTO_BYTES, to);
+  mutex_unlock(&ddata->lock);
   
-  read_idx = atomic_read(&(ddata->read_idx));
-  if ( read_idx == atomic_read(&(ddata->write_idx)) ) { // Buffer is empty
-    ddata->fDone = 0;
-    retval = wait_event_interruptible(queue, ddata->fDone);
-    if (retval) { // Spurious wakeup of event queue
-      DEBUG_ALERT("Spurious wakeup of event queue");
-      return retval;
+  return copied ? copied : -EFAULT;
+}
+
+//! \brief Returns the size of one event record in the given format
+//! \param format is one of the SILENAR_FORMAT values
+static size_t format_size(int format) {
+  switch (format) {
+  case SILENAR_FORMAT_LEGACY:
+    return sizeof (struct event);
+  case SILENAR_FORMAT_PACKED:
+    return sizeof (__u64);
+  default:
+    return sizeof (struct silenar_event);
+  }
+}
+
+//! \brief Converts one event of the ring to the format of the reader
+//! \param reader is a pointer to the open file private data
+//! \param event is the event in the ring
+//! \param out is where the converted record is written
+static void format_event(struct reader_data * reader,
+                         struct silenar_event const * event, void * out) {
+  struct event * legacy = out;
+  u64 ns, dt;
+  u32 rem, flags;
+  
+  switch (reader->format) {
+  case SILENAR_FORMAT_LEGACY:
+    ns = event->ts_ns + real_offset;
+    legacy->tv_sec  = (s32) div_u64_rem(ns, NSEC_PER_SEC, &rem);
+    legacy->tv_usec = rem / NSEC_PER_USEC;
+    legacy->value   = event->value;
+    break;
+  case SILENAR_FORMAT_PACKED:
+    dt = event->ts_ns > reader->last_ns ? event->ts_ns - reader->last_ns : 0;
+    flags = event->flags;
+    if (dt > SILENAR_PACKED_DT_MAX) {
+      dt = SILENAR_PACKED_DT_MAX;
+      flags |= SILENAR_FLAG_DT_SATURATED;
+    }
+    reader->last_ns = event->ts_ns;
+    *(__u64 *) out = SILENAR_PACKED(dt, event->value, flags);
+    break;
+  }
+}
+
+//! \brief Copies records to the destination of a read, a record the
+//! destination could only take in part is given back
+//! \param from is the first record
+//! \param records is the number of records
+//! \param size is the size of one record
+//! \param to is the destination of the read
+//! \return the number of whole records copied
+static u32 copy_records(void const * from, u32 records, size_t size,
+                        struct iov_iter * to) {
+  size_t bytes = copy_to_iter(from, records * size, to);
+  
+  iov_iter_revert(to, bytes % size);
+  return bytes / size;
+}
+
+//! \brief Copies the events [read_idx, read_idx + transfer) of the ring to
+//! the destination of a read, in the format of the reader
+//!
+//! Events in the native format are copied straight from the ring, the others
+//! are converted through the bounce page. Conversions are checked against
+//! the producer before leaving the driver, straight copies are given back
+//! if the producer overwrote them meanwhile.
+//! \param reader is a pointer to the open file private data
+//! \param to is the destination of the read
+//! \param read_idx is the index of the first event
+//! \param transfer is the number of events to copy
+//! \return the number of events copied, 0 if there is nothing to copy or
+//! the producer overwrote the first slot meanwhile, -EFAULT on error
+static ssize_t reader_copy(struct reader_data * reader, struct iov_iter * to,
+                           u32 read_idx, u32 transfer) {
+  struct silenar_ring * ring = &reader->ddata->ring;
+  size_t out_size = format_size(reader->format);
+  u32 chunk, done, j;
+  u64 last_ns;
+  
+  if (!transfer) {
+    return 0;
+  }
+  if (reader->format == SILENAR_FORMAT_NATIVE) {
+    chunk = ring_contiguous(ring, read_idx, transfer);
+    // Copy up to the upper bound of the memory allocated to the buffer
+    done = copy_records(ring_slot(ring, read_idx), chunk, EVENTS_SIZE, to);
+    // The transfer wraps around, copy the remaining events from the head
+    if (done == chunk && chunk < transfer) {
+      done += copy_records(ring->events, transfer - chunk, EVENTS_SIZE, to);
+    }
+    // If the producer reached the first copied slot in the meantime, the
+    // copy may be torn
+    if (ring_torn(ring, read_idx)) {
+      iov_iter_revert(to, done * EVENTS_SIZE);
+      return 0;
     }
+    return done ? done : -EFAULT;
   }
-  write_idx = atomic_read(&(ddata->write_idx));
-  transfer = (write_idx + SIZE - read_idx) % SIZE;
   
-  // Should we not decrement  transfer by one here?
-  if ( transfer > request) {
-    transfer = request;
-    // transfer = request - 1;
+  for (done = 0; done < transfer; done += chunk) {
+    chunk = min_t(u32, transfer - done, PAGE_SIZE / out_size);
+    last_ns = reader->last_ns;
+    for (j = 0; j < chunk; ++j) {
+      format_event(reader, ring_slot(ring, read_idx + done + j),
+                   reader->bounce + j * out_size);
+    }
+    if (ring_torn(ring, read_idx + done)) {
+      // The chunk may be torn, deliver what was copied so far
+      reader->last_ns = last_ns;
+      break;
+    }
+    j = copy_records(reader->bounce, chunk, out_size, to);
+    if (j < chunk) {
+      // The destination is full or faulted, the next packed record is
+      // relative to the last one delivered
+      reader->last_ns = j ? ring_slot(ring, read_idx + done + j - 1)->ts_ns
+                          : last_ns;
+      done += j;
+      return done ? done : -EFAULT;
+    }
   }
+  return done;
+}
+
+//! \brief Copies the oldest events not consumed by the reader to the
+//! destination of a read: a user buffer for read()/readv(), a pipe for
+//! splice(), a kernel buffer for io_uring
+//!
+//! Blocks until the reader is ready, \see reader_ready, then transfers as
+//! many whole records as fit in the destination, in the format selected by
+//! the reader. Non blocking reads return the events available right away, or
+//! -EAGAIN if there are none.
+//! Events overwritten by the producer before they could be copied are skipped
+//! and added to the reader overrun count. A reader that finds nothing to copy
+//! once it is woken, because its cursor was moved up to the producer by
+//! userspace or reset by SILENAR_IOC_SET_FORMAT, waits again.
+//! \param iocb describes the read, IOCB_NOWAIT asks not to block
+//! \param to is the destination of the read
+static ssize_t read_iter(struct kiocb * iocb, struct iov_iter * to) {
+  struct file * filp = iocb->ki_filp;
+  struct reader_data * reader = filp->private_data;
+  struct driver_data * ddata = reader->ddata;
+  struct silenar_cursor * cursor = reader->cursor;
+  u32 read_idx, cursor_idx, write_idx, transfer, lost, retries = 0;
+  bool nowait = (filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+  unsigned long flags;
+  ssize_t copied;
+  bool waited;
+  int retval;
   
-  transfer_bytes = transfer * EVENTS_SIZE;
+  size_t request = iov_iter_count(to) / format_size(reader->format);
+  if (READ_ONCE(reader->mode) == SILENAR_MODE_HISTOGRAM) {
+    return histo_read(reader, to);
+  }
+  if (request == 0) {
+    DEBUG_ALERT("Read request rejected, consult the documentation.");
+    return -EINVAL;
+  }
   
-  if (read_idx + transfer <= SIZE) {
-    // Bytes transfer doesn't wrap around the circular buffer, only one call
-    // to copy_to_user is needed
-    retval = copy_to_user(buff, events + read_idx, transfer_bytes);
-    //read_idx += (transfer - (retval / EVENTS_SIZE));
-    if (retval) {
-      goto copy_error;
-    }
-  }
-  else { // read_idx > write_idx
-    // Bytes transfer wraps around the circular buffer, first transfer the bytes
-    // up to the upper bound of the memory allocated to the buffer
-    int second_transfer = transfer_bytes - (SIZE - read_idx) * EVENTS_SIZE;
-    retval = copy_to_user(buff, events + read_idx, transfer_bytes - second_transfer);
-//    read_idx += ((transfer_bytes - second_transfer - retval) / EVENTS_SIZE);
-//    if (read_idx == SIZE) {
-//      read_idx = 0;
-//    }
-    if (retval) {
-      goto copy_error;
+  for (;;) {
+    // After a torn copy the reader is still ready, it does not wait again
+    if (!retries && nowait) {
+      // Never wait for the watermark or the wakeup timer, whatever is
+      // available is delivered now
+      if (!reader_count(reader)) {
+        return -EAGAIN;
+      }
     }
-    // Then copy the remaining bytes starting from the head of the buffer
-    retval = copy_to_user(buff, events, second_transfer);
-//    read_idx += ((second_transfer - retval) / EVENTS_SIZE);
-    if (retval) {
-      goto copy_error;
-    }  
-  }
-  // The transfer was complete, update the local read_idx variable
-  read_idx = (read_idx + transfer) % SIZE;
-  // And the global variable
-  atomic_set(&(ddata->read_idx), read_idx);
-   
-  if ( (ddata->fHang) && (gpio_get_value(GPIO_RDY) == 0) ) {
-    read_event(ddata);
-    ddata->fHang = 0;
+    else if (!retries) {
+      waited = !reader_ready(reader);
+      retval = wait_event_interruptible(ddata->queue, reader_ready(reader));
+      if (retval) { // Spurious wakeup of event queue
+        DEBUG_ALERT("Spurious wakeup of event queue");
+        return retval;
+      }
+      if (waited) {
+        spin_lock_irqsave(&ddata->stats_lock, flags);
+        lat_hist_add(ddata->wake_hist, ktime_get_ns() - ddata->wake_ns);
+        spin_unlock_irqrestore(&ddata->stats_lock, flags);
+      }
+    }
+
+    write_idx  = ring_head(&ddata->ring);
+    cursor_idx = READ_ONCE(cursor->read_idx);
+    read_idx   = cursor_idx;
+    // If the producer lapped the reader, skip to the oldest valid slot. A
+    // cursor ahead of the producer goes back to it
+    lost = ring_catch_up(&ddata->ring, write_idx, &read_idx);
+    if (read_idx != cursor_idx) {
+      WRITE_ONCE(cursor->overrun, cursor->overrun + lost);
+      WRITE_ONCE(cursor->read_idx, read_idx);
+    }
+    transfer = min_t(size_t, write_idx - read_idx, request);
+    copied = reader_copy(reader, to, read_idx, transfer);
+    if (copied) {
+      break;
+    }
+    if (!transfer) {
+      // Nothing to copy after all, wait for the next events
+      retries = 0;
+      cond_resched();
+      continue;
+    }
+    // The producer overwrote the first slot in the meantime: start over from
+    // the oldest valid slot
+    if (++retries == READ_RETRIES) {
+      DEBUG_ALERT("Events overwritten while they were copied");
+      return -EAGAIN;
+    }
+    cond_resched();
   }
-    
-  return transfer_bytes;
   
-  copy_error:
-    DEBUG_ALERT("%d bytes couldn't be transferred to user", retval);
-    return -1;
+  if (copied < 0) {
+    DEBUG_ALERT("Events couldn't be transferred to user");
+    return copied;
+  }
+  // Advance the cursor of the reader past the events copied
+  smp_store_release(&cursor->read_idx, read_idx + copied);
+  trace_silenar_copy(ddata->minor, read_idx, copied,
+                     copied * format_size(reader->format));
+    
+  return copied * format_size(reader->format);
 }
 
 //! \brief
@@ -348,47 +1470,351 @@ static ssize_t read
 //! \param count
 //! \param ppos
 static ssize_t write 
-(struct file * filp, char const * user_buff, size_t count, loff_t *ppos) {
+(struct file * filp, char const __user * user_buff, size_t count,
+ loff_t *ppos) {
+  struct reader_data * reader = filp->private_data;
+  struct driver_data * ddata = reader->ddata;
+  char command;
+  
   // Vogliamo leggere dati, non ci importa scrivere dati
-  if (user_buff == NULL) {
+  if (user_buff == NULL || count == 0) {
     return count;
   }
+  if (get_user(command, user_buff)) {
+    return -EFAULT;
+  }
 
-  switch (user_buff[0]) {
+  mutex_lock(&ddata->lock);
+  switch (command) {
   case 'S': // Start the acquisition
-    gpio_set_value(GPIO_ENB, 1);
-    gpio_set_value(GPIO_RUN, 1);
+    acquisition_run(ddata, true);
     DEBUG_ALERT("Starting the acquisition.");
     break;
   case 'E': // End the acquisition
-    gpio_set_value(GPIO_RUN, 0);
-    gpio_set_value(GPIO_ENB, 0);
+    acquisition_run(ddata, false);
     DEBUG_ALERT("Stopping the acquisition.");
     break;
   default:
     DEBUG_ALERT("Unrecognized write command.");
     break;
   }
+  mutex_unlock(&ddata->lock);
 
   return count;
 }
 
+//! \brief Handles the ioctl commands defined in silenar.h
+//! \param filep
+//! \param cmd
+//! \param arg
+static long ioctl(struct file * filp, unsigned int cmd, unsigned long arg) {
+  struct reader_data * reader = filp->private_data;
+  struct driver_data * ddata = reader->ddata;
+  struct silenar_stats stats;
+  struct silenar_format format;
+  struct silenar_discriminator discr;
+  struct silenar_livetime livetime;
+  unsigned long flags;
+  u64 now;
+  int retval;
+
+  switch (cmd) {
+  case SILENAR_IOC_WAIT: // Block until the reader has events to consume
+    retval = wait_event_interruptible(ddata->queue, reader_ready(reader));
+    if (retval) {
+      return retval;
+    }
+    return reader_count(reader);
+  case SILENAR_IOC_SET_WATERMARK: // Events needed to report POLLIN
+    if (arg < 1 || arg >= ddata->ring.size) {
+      return -EINVAL;
+    }
+    WRITE_ONCE(reader->watermark, arg);
+    return 0;
+  case SILENAR_IOC_ACK_OVERRUN: // Clear the POLLERR condition
+    retval = READ_ONCE(reader->cursor->overrun) - reader->overrun_ack;
+    reader->overrun_ack += retval;
+    return retval;
+  case SILENAR_IOC_GET_STATS: // Ring statistics of the acquisition
+    spin_lock_irqsave(&ddata->stats_lock, flags);
+    stats = ddata->stats;
+    if (ddata->full_since) {
+      // Include the time since the ring became full
+      stats.full_ns += ktime_get_ns() - ddata->full_since;
+    }
+    // And the time spent in the current mode
+    if (ddata->polling) {
+      stats.poll_mode_ns += ktime_get_ns() - ddata->mode_since;
+    }
+    else if (!ddata->simulated) {
+      stats.irq_mode_ns += ktime_get_ns() - ddata->mode_since;
+    }
+    spin_unlock_irqrestore(&ddata->stats_lock, flags);
+    if (copy_to_user((void __user *) arg, &stats, sizeof (stats))) {
+      return -EFAULT;
+    }
+    return 0;
+  case SILENAR_IOC_SET_FORMAT: // Format of the records returned by read()
+    if (copy_from_user(&format, (void __user *) arg, sizeof (format))) {
+      return -EFAULT;
+    }
+    if (format.format != SILENAR_FORMAT_LEGACY &&
+        format.format != SILENAR_FORMAT_NATIVE &&
+        format.format != SILENAR_FORMAT_PACKED) {
+      return -EINVAL;
+    }
+    mutex_lock(&ddata->lock);
+    // Start from the next event, so that no record predates base_ns
+    reader->format  = format.format;
+    reader->last_ns = ktime_get_ns();
+    WRITE_ONCE(reader->cursor->read_idx,
+               ring_head(&ddata->ring));
+    mutex_unlock(&ddata->lock);
+    format.record_size = format_size(format.format);
+    format.base_ns     = reader->last_ns;
+    if (copy_to_user((void __user *) arg, &format, sizeof (format))) {
+      return -EFAULT;
+    }
+    return 0;
+  case SILENAR_IOC_SET_DISCRIMINATOR: // Shared by all the readers
+    if (copy_from_user(&discr, (void __user *) arg, sizeof (discr))) {
+      return -EFAULT;
+    }
+    if (discr.lld > discr.uld || discr.uld >= SILENAR_HISTO_BINS ||
+        discr.rebin >= BUS_WIDTH) {
+      return -EINVAL;
+    }
+    WRITE_ONCE(ddata->discr, DISCR(discr.lld, discr.uld, discr.rebin));
+    return 0;
+  case SILENAR_IOC_GET_DISCRIMINATOR:
+    memset(&discr, 0, sizeof (discr));
+    retval = READ_ONCE(ddata->discr);
+    discr.lld   = DISCR_LLD(retval);
+    discr.uld   = DISCR_ULD(retval);
+    discr.rebin = DISCR_REBIN(retval);
+    if (copy_to_user((void __user *) arg, &discr, sizeof (discr))) {
+      return -EFAULT;
+    }
+    return 0;
+  case SILENAR_IOC_GET_LIVETIME: // Dead time of the current or last run
+    now = ktime_get_ns();
+    spin_lock_irqsave(&ddata->stats_lock, flags);
+    livetime = ddata->livetime;
+    if (ddata->running) {
+      // Include the run and the dead period still in progress
+      livetime.real_ns  = now - ddata->run_start;
+      livetime.accepted = ddata->stats.events - ddata->run_events;
+      if (ddata->dead_since) {
+        livetime.dead_ns += now - ddata->dead_since;
+      }
+    }
+    spin_unlock_irqrestore(&ddata->stats_lock, flags);
+    livetime.live_ns = livetime.real_ns - min(livetime.dead_ns,
+                                              livetime.real_ns);
+    if (copy_to_user((void __user *) arg, &livetime, sizeof (livetime))) {
+      return -EFAULT;
+    }
+    return 0;
+  case SILENAR_IOC_SET_MODE: // Consume events or fill a histogram
+    mutex_lock(&ddata->lock);
+    retval = reader_set_mode(reader, arg);
+    mutex_unlock(&ddata->lock);
+    return retval;
+  case SILENAR_IOC_HISTO_SNAPSHOT: // Refresh the mapped histogram
+    if (arg & ~SILENAR_HISTO_CLEAR) {
+      return -EINVAL;
+    }
+    if (READ_ONCE(reader->mode) != SILENAR_MODE_HISTOGRAM) {
+      return -EINVAL;
+    }
+    mutex_lock(&ddata->lock);
+    histo_snapshot(reader, arg & SILENAR_HISTO_CLEAR);
+    mutex_unlock(&ddata->lock);
+    return 0;
+  default:
+    DEBUG_ALERT("Unrecognized ioctl command.");
+    return -ENOTTY;
+  }
+}
+
+//! \brief Reports the device readable once the reader has at least
+//! watermark events to consume, and in error after it lost events
+//!
+//! The error condition persists until the reader catches up with the
+//! producer and acknowledges the overrun with SILENAR_IOC_ACK_OVERRUN.
+//! \param filep
+//! \param wait
+static __poll_t poll(struct file * filp, poll_table * wait) {
+  struct reader_data * reader = filp->private_data;
+  __poll_t mask = 0;
+
+  poll_wait(filp, &reader->ddata->queue, wait);
+  
+  if (READ_ONCE(reader->mode) == SILENAR_MODE_HISTOGRAM) {
+    // A snapshot of the histogram can be read at any time
+    return EPOLLIN | EPOLLRDNORM;
+  }
+  if (reader_ready(reader)) {
+    mask |= EPOLLIN | EPOLLRDNORM;
+  }
+  if (reader_overrun(reader) ||
+      READ_ONCE(reader->cursor->overrun) != reader->overrun_ack) {
+    mask |= EPOLLERR;
+  }
+  return mask;
+}
+
+//! \brief Keeps mprotect() from making a read only mapping writable
+//! \param vma is the mapping
+static void vma_deny_write(struct vm_area_struct * vma) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 3, 0)
+  vma->vm_flags &= ~VM_MAYWRITE;
+#else
+  // The flags are only changed through the accessors since 6.3
+  vm_flags_clear(vma, VM_MAYWRITE);
+#endif
+}
+
+//! \brief Maps either the cursor page of the reader, the histogram snapshot
+//! or the shared ring to userspace, see silenar.h for the layout and the
+//! protocol to consume the events
+//! \param filep
+//! \param vma
+static int mmap(struct file * filp, struct vm_area_struct * vma) {
+  struct reader_data * reader = filp->private_data;
+  int retval;
+  
+  if (vma->vm_pgoff == (SILENAR_MMAP_HISTO >> PAGE_SHIFT)) {
+    // The histogram snapshot of the reader, read only
+    if (vma->vm_flags & VM_WRITE) {
+      return -EPERM;
+    }
+    mutex_lock(&reader->ddata->lock);
+    retval = reader->histo ? remap_vmalloc_range(vma, reader->histo, 0)
+                           : -EINVAL;
+    mutex_unlock(&reader->ddata->lock);
+    vma_deny_write(vma);
+    return retval;
+  }
+  if (vma->vm_pgoff == 0) {
+    // The cursor is the only page userspace is allowed to write
+    if (vma->vm_end - vma->vm_start != PAGE_SIZE) {
+      return -EINVAL;
+    }
+    return vm_insert_page(vma, vma->vm_start, virt_to_page(reader->cursor));
+  }
+  // The ring is shared by all the readers, it is mapped read only
+  if (vma->vm_flags & VM_WRITE) {
+    return -EPERM;
+  }
+  vma_deny_write(vma);
+  // Checks on its own that the vma fits inside the ring
+  return remap_vmalloc_range(vma, reader->ddata->ring.mem,
+                             vma->vm_pgoff - 1);
+}
+
+//! \brief Prints a latency histogram, one line per non empty bin
+//! \param s is the seq_file of the debugfs file
+//! \param ddata is a pointer to the char device private data
+//! \param hist is the histogram, LAT_BINS counters
+static void lat_hist_show(struct seq_file * s, struct driver_data * ddata,
+                          u64 const * hist) {
+  u64 copy[LAT_BINS];
+  unsigned long flags;
+  int k;
+  
+  spin_lock_irqsave(&ddata->stats_lock, flags);
+  memcpy(copy, hist, sizeof (copy));
+  spin_unlock_irqrestore(&ddata->stats_lock, flags);
+  
+  seq_puts(s, "# from_ns to_ns count\n");
+  for (k = 0; k < LAT_BINS; ++k) {
+    if (copy[k]) {
+      seq_printf(s, "%llu %llu %llu\n", k ? 1ULL << k : 0,
+                 (2ULL << k) - 1, copy[k]);
+    }
+  }
+}
+
+//! \brief Shows the histogram of the RDY interrupt service time
+static int irq_hist_show(struct seq_file * s, void * unused) {
+  struct driver_data * ddata = s->private;
+  
+  lat_hist_show(s, ddata, ddata->irq_hist);
+  return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(irq_hist);
+
+//! \brief Shows the histogram of the wakeup to read latency
+static int wake_hist_show(struct seq_file * s, void * unused) {
+  struct driver_data * ddata = s->private;
+  
+  lat_hist_show(s, ddata, ddata->wake_hist);
+  return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(wake_hist);
+
 //! \brief Specifies the callback functions for the device file operations
 static struct file_operations fops = {
     .open   = open,
     .release = close,
-    .read = read,
-    .write = write
+    .read_iter = read_iter,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 5, 0)
+    .splice_read = generic_file_splice_read,
+#else
+    .splice_read = copy_splice_read,
+#endif
+    .write = write,
+    .unlocked_ioctl = ioctl,
+    .poll = poll,
+    .mmap = mmap
   };
 
 //! \brief Entry function of the kernel module
 //!
 static int silenar_init(void) {
-  int status;
+  struct driver_data * ddata;
+  int status, j, k;
   
+  if (adcs < 1 || adcs > ADC_MAX) {
+    DEBUG_ALERT("The number of ADCs must be between 1 and %d", ADC_MAX);
+    return -EINVAL;
+  }
+  // The default table only fits the first ADC
+  if (adcs > 1 && npins < adcs * PIN_NUM && !sim_rate) {
+    DEBUG_ALERT("The pins of all the %d ADCs must be given", adcs);
+    return -EINVAL;
+  }
+  real_offset = ktime_get_real_ns() - ktime_get_ns();
+  
+  for (j = 0; j < adcs; ++j) {
+    ddata = &ddatas[j];
+    memcpy(ddata->gpios, gpio_table, sizeof (gpio_table));
+    for (k = 0; k < PIN_NUM && j * PIN_NUM + k < npins; ++k) {
+      ddata->gpios[k].gpio = pins[j * PIN_NUM + k];
+    }
+    ddata->minor = j;
+    init_waitqueue_head(&ddata->queue);
+    mutex_init(&ddata->lock);
+    INIT_LIST_HEAD(&ddata->readers);
+    spin_lock_init(&ddata->stats_lock);
+    ddata->discr = DISCR(0, SILENAR_HISTO_BINS - 1, 0);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 13, 0)
+    hrtimer_init(&ddata->wake_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    ddata->wake_timer.function = wake_timer_expired;
+    // The simulated ADC runs in softirq context, not with interrupts off
+    hrtimer_init(&ddata->sim_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+    ddata->sim_timer.function = sim_tick;
+#else
+    hrtimer_setup(&ddata->wake_timer, wake_timer_expired, CLOCK_MONOTONIC,
+                  HRTIMER_MODE_REL);
+    hrtimer_setup(&ddata->sim_timer, sim_tick, CLOCK_MONOTONIC,
+                  HRTIMER_MODE_REL_SOFT);
+#endif
+  }
   
   // 1. Allocare le risorse per un char device
-  status = alloc_chrdev_region (&device, BASE_MINOR, DEV_NUM, NAME);
+  status = alloc_chrdev_region (&device, BASE_MINOR, adcs, NAME);
   if (status < 0) {
     device = 0;
     goto failure;
@@ -399,25 +1825,50 @@ static int silenar_init(void) {
   cdev.owner = THIS_MODULE;
   
   // 3. Aggiunta al sistema di cdev
-  status  = cdev_add (&cdev, device, DEV_NUM);
+  status  = cdev_add (&cdev, device, adcs);
   if (status) {
     goto failure;
   }
   cdev_flag = 1;
   
   // 4. Creazione della classe di device (unica)
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 4, 0)
   dev_class = class_create(THIS_MODULE, NAME);
+#else
+  dev_class = class_create(NAME);
+#endif
   if (IS_ERR(dev_class)) {
-    status = (int) dev_class;
+    status = PTR_ERR(dev_class);
     dev_class = NULL;
     goto failure;
   }
-  // 5. Creazione di FILE in /dev
-  dev_device = device_create(dev_class, NULL, device, NULL, NAME);
-  if (IS_ERR(dev_device)) {
-    status = (int) dev_device;
-    dev_device = NULL;
-    goto failure;
+  // 5. Creazione di FILE in /dev, uno per ADC
+  for (j = 0; j < adcs; ++j) {
+    dev_devices[j] = j ?
+        device_create(dev_class, NULL, device + j, NULL, NAME "%d", j) :
+        device_create(dev_class, NULL, device, NULL, NAME);
+    if (IS_ERR(dev_devices[j])) {
+      status = PTR_ERR(dev_devices[j]);
+      dev_devices[j] = NULL;
+      // Remove the files of the lower minors before the class goes away
+      while (j--) {
+        device_destroy(dev_class, device + j);
+        dev_devices[j] = NULL;
+      }
+      goto failure;
+    }
+  }
+  
+  // 6. Istogrammi delle latenze in debugfs, facoltativi
+  debugfs_root = debugfs_create_dir(NAME, NULL);
+  for (j = 0; j < adcs; ++j) {
+    ddata = &ddatas[j];
+    ddata->debugfs = debugfs_create_dir(dev_name(dev_devices[j]),
+                                        debugfs_root);
+    debugfs_create_file("irq_service_ns", S_IRUGO, ddata->debugfs, ddata,
+                        &irq_hist_fops);
+    debugfs_create_file("wake_to_read_ns", S_IRUGO, ddata->debugfs, ddata,
+                        &wake_hist_fops);
   }
   
   DEBUG_ALERT("All's well that ends well.");
@@ -0,0 +1,264 @@
+//! \file silenar.h
+//! \brief Userspace interface of the silenar char device
+//!
+//! This header is shared by the kernel module and by its clients. It defines
+//! the layout of the event records, of the memory mapped acquisition ring and
+//! the ioctl commands understood by /dev/silenar.
+
+#ifndef SILENAR_H
+#define SILENAR_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+//! \brief struct event defines the data for each SILENA ADC event in the
+//! legacy format, SILENAR_FORMAT_LEGACY
+//!
+//! The timestamp is CLOCK_REALTIME with microsecond resolution.
+struct event {
+  __s32 tv_sec;   ///< Event timestamp, seconds field
+  __s32 tv_usec;  ///< Event timestamp, microseconds field
+  __u32 value;    ///< Event ADC value
+};
+
+//! \brief struct silenar_event defines the data for each SILENA ADC event in
+//! the native format, SILENAR_FORMAT_NATIVE. The ring stores this format
+//!
+//! The timestamp is CLOCK_MONOTONIC in nanoseconds, the same clock as
+//! clock_gettime(CLOCK_MONOTONIC) in userspace.
+struct silenar_event {
+  __u64 ts_ns;    ///< Event timestamp, nanoseconds
+  __u32 value;    ///< Event ADC value, 13 bits
+  __u32 flags;    ///< SILENAR_FLAG values
+};
+
+//! \def SILENAR_FORMAT_LEGACY
+//! \brief read() returns struct event records, the default
+#define SILENAR_FORMAT_LEGACY 1
+//! \def SILENAR_FORMAT_NATIVE
+//! \brief read() returns struct silenar_event records, copied straight from
+//! the ring
+#define SILENAR_FORMAT_NATIVE 2
+//! \def SILENAR_FORMAT_PACKED
+//! \brief read() returns 8 byte packed records, see SILENAR_PACKED
+#define SILENAR_FORMAT_PACKED 3
+
+//! \def SILENAR_PACKED
+//! \brief Builds a packed record: bits 0-12 hold the ADC value, bits 13-15
+//! the low SILENAR_FLAG bits and bits 16-63 the time in nanoseconds elapsed
+//! since the previous record. The first record after SILENAR_IOC_SET_FORMAT is
+//! relative to the base_ns returned by the ioctl
+#define SILENAR_PACKED(dt, value, flags) \
+  (((__u64) (dt) << 16) | (((flags) & 0x7) << 13) | ((value) & 0x1FFF))
+#define SILENAR_PACKED_VALUE(rec) ((__u32) (rec) & 0x1FFF)
+#define SILENAR_PACKED_FLAGS(rec) (((__u32) (rec) >> 13) & 0x7)
+#define SILENAR_PACKED_DT(rec) ((__u64) (rec) >> 16)
+//! \def SILENAR_PACKED_DT_MAX
+//! \brief The largest time interval of a packed record, about 78 hours
+#define SILENAR_PACKED_DT_MAX ((1ULL << 48) - 1)
+
+//! \def SILENAR_FLAG_DT_SATURATED
+//! \brief The time since the previous packed record exceeded
+//! SILENAR_PACKED_DT_MAX, only set in packed records
+#define SILENAR_FLAG_DT_SATURATED 0x4
+
+//! \brief struct silenar_format is the argument of SILENAR_IOC_SET_FORMAT
+struct silenar_format {
+  __u32 format;       ///< In: one of the SILENAR_FORMAT values
+  __u32 record_size;  ///< Out: size in bytes of one record
+  __u64 base_ns;      ///< Out: CLOCK_MONOTONIC time of the format switch
+};
+
+//! \def SILENAR_RING_VERSION
+//! \brief Version of the memory mapped ring layout
+#define SILENAR_RING_VERSION 3
+
+//! \brief struct silenar_ring_header is the first page of the memory mapped
+//! acquisition ring
+//!
+//! Every open file of the device is an independent reader of the same ring.
+//! The device file can be mapped at two offsets:
+//!   - offset 0, one page long: the \see silenar_cursor of this reader, the
+//!     only page that is mapped writable
+//!   - offset of one page: the ring, read only. It starts with this header,
+//!     the event slots follow \a data_offset bytes later. The slots hold
+//!     struct silenar_event records
+//!
+//! Indexes run free and wrap at 2^32, the slot of an index is obtained as
+//! (index & (size - 1)). The producer never waits for the readers: the slot
+//! of index i is overwritten while the event of index (i + size) is written,
+//! so a reader lost events as soon as (write_idx - read_idx) reaches size.
+//!
+//! A reader consumes events as follows:
+//!   1. load write_idx with acquire semantics
+//!   2. if (write_idx - read_idx) >= size, skip the lost events by setting
+//!      read_idx to (write_idx - size + 1)
+//!   3. copy the slots between read_idx and write_idx
+//!   4. load write_idx again: the copied slots with index lower than
+//!      (write_idx - size + 1) may have been overwritten, discard them
+//!   5. store the new read_idx with release semantics
+//! When no event is left the reader blocks with the SILENAR_IOC_WAIT ioctl,
+//! or with poll()/epoll on the device file descriptor.
+struct silenar_ring_header {
+  __u32 version;      ///< Layout version, equal to SILENAR_RING_VERSION
+  __u32 size;         ///< Number of event slots, always a power of two
+  __u32 event_size;   ///< Size in bytes of one event slot
+  __u32 data_offset;  ///< Offset in bytes of the first slot in the mapping
+  __u32 write_idx;    ///< Producer index, only written by the driver
+};
+
+//! \brief struct silenar_cursor holds the position of one reader in the ring
+//!
+//! The cursor of a new reader starts at the write index of the ring, so it
+//! only sees the events produced after it opened the device.
+struct silenar_cursor {
+  __u32 read_idx;     ///< Consumer index, only written by the reader
+  __u32 overrun;      ///< Events lost by read(), mmap readers count their own
+};
+
+//! \def SILENAR_BATCH_BINS
+//! \brief Number of bins of the batch size distribution in silenar_stats
+#define SILENAR_BATCH_BINS 24
+
+//! \brief struct silenar_stats reports how the ring coped with the event rate
+//! since the first reader opened the device
+//!
+//! The backlog is the number of events the slowest reader did not consume
+//! yet. When it reaches \a size the ring is full and the next events
+//! overwrite events that reader has not seen.
+//!
+//! Bin k of \a batch_hist counts the wakeups of the readers that delivered
+//! between 2^k and 2^(k+1) - 1 new events, the last bin also counts the
+//! larger batches.
+struct silenar_stats {
+  __u64 events;       ///< Events stored in the ring
+  __u64 dropped;      ///< Events overwritten before the slowest reader got them
+  __u64 full_ns;      ///< Time spent with a full ring, in nanoseconds
+  __u32 size;         ///< Depth of the ring, in events
+  __u32 high_water;   ///< Largest backlog seen, in events
+  __u64 wakeups;      ///< Times the readers were woken
+  __u64 batch_hist[SILENAR_BATCH_BINS]; ///< Events per wakeup, log2 binned
+  __u64 readout_ns;   ///< Time spent reading the bus and toggling ACK
+  __u32 readout_max_ns; ///< Longest readout of a single event
+  __u32 ack_max_ns;   ///< Longest time from the RDY interrupt to the ACK
+  __u64 ack_ns;       ///< Sum of the times from the RDY interrupt to the ACK
+  __u64 below_lld;    ///< Events rejected by the lower level discriminator
+  __u64 above_uld;    ///< Events rejected by the upper level discriminator
+  __u64 irq_mode_ns;  ///< Time spent reading the Silena on interrupts
+  __u64 poll_mode_ns; ///< Time spent reading the Silena by polling
+  __u64 poll_events;  ///< Conversions read by polling, the others on interrupts
+  __u64 poll_entries; ///< Switches from interrupts to polling
+};
+
+//! \brief struct silenar_livetime reports the dead time of the Silena during
+//! the current run, or the last one if the acquisition is stopped
+//!
+//! A run lasts from the start to the stop of the acquisition. The Silena is
+//! dead while the LVE line is asserted, from the start of a conversion until
+//! it is ready for the next one. The true input rate is estimated as
+//! conversions / live_ns, the rate of the stored events as
+//! accepted / real_ns. The simulated ADC has no dead time.
+struct silenar_livetime {
+  __u64 real_ns;      ///< Duration of the run
+  __u64 live_ns;      ///< Time the Silena was ready to convert
+  __u64 dead_ns;      ///< Time the Silena was busy, real_ns - live_ns
+  __u64 conversions;  ///< Conversions started, counted on LVE
+  __u64 accepted;     ///< Events stored in the ring during the run
+};
+
+//! \brief struct silenar_discriminator selects the events stored in the ring
+//!
+//! Only the events with lld <= value <= uld are stored, the others are
+//! acknowledged and counted in silenar_stats. The accepted values are then
+//! shifted right by \a rebin bits: a rebin of 1 turns the 8192 channels of
+//! the ADC into 4096. The setting is shared by all the readers and kept
+//! across acquisitions.
+struct silenar_discriminator {
+  __u32 lld;          ///< Lowest value accepted, 0 by default
+  __u32 uld;          ///< Highest value accepted, 8191 by default
+  __u32 rebin;        ///< Bits dropped from the accepted values, 0 to 12
+  __u32 reserved;
+};
+
+//! \def SILENAR_HISTO_BINS
+//! \brief Number of channels of the histogram mode, one per ADC value
+#define SILENAR_HISTO_BINS 8192
+
+//! \def SILENAR_MODE_EVENTS
+//! \brief The reader consumes the events of the ring, the default mode
+#define SILENAR_MODE_EVENTS 0
+//! \def SILENAR_MODE_HISTOGRAM
+//! \brief The driver fills a histogram of SILENAR_HISTO_BINS 64 bit counters
+//! for the reader. read() returns a snapshot of the whole histogram, the
+//! snapshot can also be mapped read only at offset SILENAR_MMAP_HISTO and
+//! refreshed with SILENAR_IOC_HISTO_SNAPSHOT
+#define SILENAR_MODE_HISTOGRAM 1
+
+//! \def SILENAR_MMAP_HISTO
+//! \brief The mmap offset of the histogram snapshot of the reader
+#define SILENAR_MMAP_HISTO (1UL << 30)
+
+//! \def SILENAR_HISTO_CLEAR
+//! \brief Flag of SILENAR_IOC_HISTO_SNAPSHOT: the histogram restarts from
+//! zero after this snapshot, no event is lost or counted twice
+#define SILENAR_HISTO_CLEAR 1
+
+//! \def SILENAR_IOC_MAGIC
+//! \brief The ioctl type number of the silenar device
+#define SILENAR_IOC_MAGIC 'S'
+
+//! \def SILENAR_IOC_WAIT
+//! \brief Blocks until the ring holds at least one event. Returns the number
+//! of events available to the reader
+#define SILENAR_IOC_WAIT _IO(SILENAR_IOC_MAGIC, 1)
+
+//! \def SILENAR_IOC_SET_WATERMARK
+//! \brief Sets the number of events the ring must hold before poll() reports
+//! the device readable and before read() or SILENAR_IOC_WAIT return. Fewer
+//! events are delivered once they waited for the wake_usec module parameter.
+//! The argument is passed by value, the default is 1
+#define SILENAR_IOC_SET_WATERMARK _IO(SILENAR_IOC_MAGIC, 2)
+
+//! \def SILENAR_IOC_ACK_OVERRUN
+//! \brief Acknowledges the events dropped so far, clearing the POLLERR
+//! condition. Returns the number of events dropped since the previous call
+#define SILENAR_IOC_ACK_OVERRUN _IO(SILENAR_IOC_MAGIC, 3)
+
+//! \def SILENAR_IOC_GET_STATS
+//! \brief Copies the ring statistics to a struct silenar_stats
+#define SILENAR_IOC_GET_STATS _IOR(SILENAR_IOC_MAGIC, 4, struct silenar_stats)
+
+//! \def SILENAR_IOC_SET_MODE
+//! \brief Selects the mode of the reader, SILENAR_MODE_EVENTS or
+//! SILENAR_MODE_HISTOGRAM. The argument is passed by value
+#define SILENAR_IOC_SET_MODE _IO(SILENAR_IOC_MAGIC, 5)
+
+//! \def SILENAR_IOC_HISTO_SNAPSHOT
+//! \brief Updates the mapped histogram snapshot of a reader in histogram
+//! mode. The argument is passed by value, 0 or SILENAR_HISTO_CLEAR
+#define SILENAR_IOC_HISTO_SNAPSHOT _IO(SILENAR_IOC_MAGIC, 6)
+
+//! \def SILENAR_IOC_SET_FORMAT
+//! \brief Selects the format of the records returned by read(), takes a
+//! struct silenar_format. The reader skips the events it did not read yet
+#define SILENAR_IOC_SET_FORMAT _IOWR(SILENAR_IOC_MAGIC, 7, struct silenar_format)
+
+//! \def SILENAR_IOC_SET_DISCRIMINATOR
+//! \brief Sets the discriminator and the rebinning applied to the events
+//! before they are stored, takes a struct silenar_discriminator
+#define SILENAR_IOC_SET_DISCRIMINATOR \
+  _IOW(SILENAR_IOC_MAGIC, 8, struct silenar_discriminator)
+
+//! \def SILENAR_IOC_GET_DISCRIMINATOR
+//! \brief Copies the current discriminator setting to a struct
+//! silenar_discriminator
+#define SILENAR_IOC_GET_DISCRIMINATOR \
+  _IOR(SILENAR_IOC_MAGIC, 9, struct silenar_discriminator)
+
+//! \def SILENAR_IOC_GET_LIVETIME
+//! \brief Copies the live and dead time of the run to a struct
+//! silenar_livetime
+#define SILENAR_IOC_GET_LIVETIME \
+  _IOR(SILENAR_IOC_MAGIC, 10, struct silenar_livetime)
+
+#endif // SILENAR_H
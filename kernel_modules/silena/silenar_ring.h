@@ -0,0 +1,176 @@
+//! \file silenar_ring.h
+//! \brief The event ring of silenar, independent of the Silena hardware
+//!
+//! The ring follows the protocol documented with struct silenar_ring_header:
+//! a single producer that never waits, free running indexes over a power of
+//! two number of slots, and readers that detect on their own the events they
+//! lost. The functions hold no lock and touch no hardware, so the ring can be
+//! exercised without the driver: see silenar_ring_test.c, the KUnit suite,
+//! and silenar_ring_bench.c, the throughput benchmark.
+
+#ifndef SILENAR_RING_H
+#define SILENAR_RING_H
+
+#include <linux/compiler.h>
+#include <linux/errno.h>
+#include <linux/minmax.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+
+#include "silenar.h"
+
+//! \brief struct silenar_ring is the memory of the ring and its layout
+struct silenar_ring {
+  void * mem;   ///< Header page followed by the slots, mappable by userspace
+  struct silenar_ring_header * header;  ///< Write index shared with userspace
+  struct silenar_event * events;        ///< The slots
+  u32 size;     ///< Number of slots, a power of two
+};
+
+//! \brief Allocates the memory of the ring, page aligned and zeroed so that
+//! it can be safely mapped to userspace. The current memory is kept when the
+//! number of slots does not change
+//! \param ring is the ring, zeroed or previously initialized
+//! \param size is the number of slots, a power of two
+//! \return 0 on success, -ENOMEM
+static inline int ring_init(struct silenar_ring * ring, u32 size) {
+  if (ring->mem && ring->size == size) {
+    return 0;
+  }
+  vfree(ring->mem);
+  ring->mem = vmalloc_user(PAGE_SIZE +
+                           PAGE_ALIGN((size_t) size * sizeof (*ring->events)));
+  if (!ring->mem) {
+    ring->size = 0;
+    return -ENOMEM;
+  }
+  ring->size   = size;
+  ring->header = ring->mem;
+  ring->events = ring->mem + PAGE_SIZE;
+
+  ring->header->version     = SILENAR_RING_VERSION;
+  ring->header->size        = size;
+  ring->header->event_size  = sizeof (*ring->events);
+  ring->header->data_offset = PAGE_SIZE;
+  return 0;
+}
+
+//! \brief Releases the memory of the ring
+//! \param ring is the ring
+static inline void ring_free(struct silenar_ring * ring) {
+  vfree(ring->mem);
+  ring->mem  = NULL;
+  ring->size = 0;
+}
+
+//! \brief Returns the slot of an index
+//! \param ring is the ring
+//! \param idx is a free running index
+static inline struct silenar_event *
+ring_slot(struct silenar_ring const * ring, u32 idx) {
+  return ring->events + (idx & (ring->size - 1));
+}
+
+//! \brief Returns the write index, the slots below it are published
+//! \param ring is the ring
+static inline u32 ring_head(struct silenar_ring const * ring) {
+  return smp_load_acquire(&ring->header->write_idx);
+}
+
+//! \brief Stores an event. When the ring is full the oldest event is
+//! overwritten, each reader accounts for the events it lost on its own.
+//! Only one producer may call it at a time
+//! \param ring is the ring
+//! \param ns is the timestamp of the event
+//! \param value is the ADC value of the event
+//! \return the index of the event
+static inline u32 ring_push(struct silenar_ring * ring, u64 ns, u32 value) {
+  u32 write_idx = ring->header->write_idx;
+  struct silenar_event * event = ring_slot(ring, write_idx);
+
+  // Readers must see the previous write index before the slot is overwritten
+  smp_wmb();
+  event->ts_ns = ns;
+  event->value = value;
+  event->flags = 0;
+  // Publish the slot before the index that makes it visible
+  smp_store_release(&ring->header->write_idx, write_idx + 1);
+  return write_idx;
+}
+
+//! \brief Returns true if the slot of read_idx was overwritten, or is being
+//! overwritten, by the producer that reached write_idx
+//! \param ring is the ring
+//! \param write_idx is a write index loaded by the reader
+//! \param read_idx is the index of the reader
+static inline bool ring_lapped(struct silenar_ring const * ring,
+                               u32 write_idx, u32 read_idx) {
+  return write_idx - read_idx >= ring->size;
+}
+
+//! \brief Returns the number of events a reader can consume. The read index
+//! may come from userspace, it is never trusted to be consistent
+//! \param ring is the ring
+//! \param read_idx is the index of the reader
+static inline u32 ring_available(struct silenar_ring const * ring,
+                                 u32 read_idx) {
+  return min(ring_head(ring) - read_idx, ring->size - 1);
+}
+
+//! \brief Returns the number of events stored after read_idx and before
+//! write_idx, more than the size of the ring if the reader was lapped. The
+//! read index may come from userspace: an index ahead of the producer is
+//! not one a reader can reach, it counts as a reader with no backlog
+//! \param ring is the ring
+//! \param write_idx is the write index
+//! \param read_idx is the index of the reader
+static inline u32 ring_backlog(struct silenar_ring const * ring,
+                               u32 write_idx, u32 read_idx) {
+  u32 backlog = write_idx - read_idx;
+  return (s32) backlog < 0 ? 0 : backlog;
+}
+
+//! \brief Moves a lapped reader to the oldest slot that is still valid. A
+//! read index ahead of the producer, see ring_backlog(), is moved back to
+//! the write index: the reader lost nothing, it has nothing to read
+//! \param ring is the ring
+//! \param write_idx is a write index loaded by the reader
+//! \param read_idx is the index of the reader, updated
+//! \return the number of events the reader lost
+static inline u32 ring_catch_up(struct silenar_ring const * ring,
+                                u32 write_idx, u32 * read_idx) {
+  u32 backlog = ring_backlog(ring, write_idx, *read_idx);
+  u32 lost = 0;
+
+  if (backlog >= ring->size) {
+    lost = backlog - (ring->size - 1);
+    *read_idx += lost;
+  }
+  else if (!backlog) {
+    *read_idx = write_idx;
+  }
+  return lost;
+}
+
+//! \brief Returns the number of the count events from idx that are stored
+//! in contiguous slots, before the end of the ring
+//! \param ring is the ring
+//! \param idx is the index of the first event
+//! \param count is the number of events
+static inline u32 ring_contiguous(struct silenar_ring const * ring,
+                                  u32 idx, u32 count) {
+  return min(count, ring->size - (idx & (ring->size - 1)));
+}
+
+//! \brief Returns true if events copied from the slot of idx on may be torn,
+//! because the producer reached that slot while they were copied. Called
+//! after the copy
+//! \param ring is the ring
+//! \param idx is the index of the first event copied
+static inline bool ring_torn(struct silenar_ring const * ring, u32 idx) {
+  // Order the copy before the second look at the write index
+  smp_rmb();
+  return ring_lapped(ring, READ_ONCE(ring->header->write_idx), idx);
+}
+
+#endif // SILENAR_RING_H
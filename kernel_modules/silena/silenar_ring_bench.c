@@ -0,0 +1,214 @@
+//! \file silenar_ring_bench.c
+//! \brief Producer/consumer throughput benchmark of the event ring, see
+//! silenar_ring.h
+//!
+//! Loading the module runs one benchmark and prints its results to the kernel
+//! log. A producer thread stores \a events events as fast as it can, like
+//! the driver with a Silena that never waits. A consumer thread follows the
+//! read protocol of silenar.h with batches of up to \a batch events and checks
+//! that every event it got is the one of its index. The two threads can be
+//! bound to different CPUs to measure the cost of sharing the ring:
+//!
+//!   insmod silenar_ring_bench.ko events=100000000 slots=65536 batch=512 \
+//!          producer_cpu=0 consumer_cpu=1
+//!   dmesg | tail -3
+
+#include <linux/completion.h>
+#include <linux/kthread.h>
+#include <linux/log2.h>
+#include <linux/module.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/timekeeping.h>
+
+#include "silenar_ring.h"
+
+//! \def BENCH_RESCHED
+//! \brief Iterations of the threads between two reschedule points
+#define BENCH_RESCHED 4096
+
+static ulong events = 1UL << 26;  ///< Events stored by the producer
+static uint slots = 1U << 16;     ///< Slots of the ring, rounded to a power of 2
+static uint batch = 512;          ///< Largest batch copied by the consumer
+static int producer_cpu = 0;      ///< CPU of the producer, -1 for any
+static int consumer_cpu = 1;      ///< CPU of the consumer, -1 for any
+
+module_param(events, ulong, S_IRUGO);
+module_param(slots, uint, S_IRUGO);
+module_param(batch, uint, S_IRUGO);
+module_param(producer_cpu, int, S_IRUGO);
+module_param(consumer_cpu, int, S_IRUGO);
+
+//! \brief struct bench holds the ring and the results of the two threads
+struct bench {
+  struct silenar_ring ring;
+  struct completion go;       ///< Released once both threads exist
+  struct completion done[2];  ///< Completed by the producer and the consumer
+  bool produced;        ///< Set by the producer after its last event
+  u64 producer_ns;      ///< Time the producer took
+  u64 consumer_ns;      ///< Time the consumer took
+  u64 consumed;         ///< Events copied by the consumer
+  u64 lost;             ///< Events overwritten before the consumer got them
+  u64 torn;             ///< Copies discarded because the producer caught up
+  u64 errors;           ///< Events copied with the wrong index
+};
+
+//! \brief Producer thread, stores the events with their index as timestamp
+//! \param arg is a pointer to the struct bench
+static int bench_producer(void * arg) {
+  struct bench * bench = arg;
+  u64 start, j;
+
+  wait_for_completion(&bench->go);
+  start = ktime_get_ns();
+  for (j = 0; j < events; ++j) {
+    ring_push(&bench->ring, j, (u32) j & 0x1FFF);
+    if (j % BENCH_RESCHED == 0) {
+      cond_resched();
+    }
+  }
+  bench->producer_ns = ktime_get_ns() - start;
+  smp_store_release(&bench->produced, true);
+  complete(&bench->done[0]);
+  return 0;
+}
+
+//! \brief Consumer thread, copies the events out of the ring the way read()
+//! does, skipping the events it lost
+//! \param arg is a pointer to the struct bench
+static int bench_consumer(void * arg) {
+  struct bench * bench = arg;
+  struct silenar_ring * ring = &bench->ring;
+  struct silenar_event * buf;
+  u32 read_idx = 0, write_idx, count, chunk, j;
+  u64 start, spins = 0;
+
+  buf = kmalloc_array(batch, sizeof (*buf), GFP_KERNEL);
+  wait_for_completion(&bench->go);
+  start = ktime_get_ns();
+  while (buf) {
+    if (++spins % BENCH_RESCHED == 0) {
+      cond_resched();
+    }
+    write_idx = ring_head(ring);
+    bench->lost += ring_catch_up(ring, write_idx, &read_idx);
+    count = min(write_idx - read_idx, batch);
+    if (!count) {
+      // The producer is done once it published its last event
+      if (smp_load_acquire(&bench->produced) && ring_head(ring) == read_idx) {
+        break;
+      }
+      cpu_relax();
+      continue;
+    }
+    chunk = ring_contiguous(ring, read_idx, count);
+    memcpy(buf, ring_slot(ring, read_idx), chunk * sizeof (*buf));
+    if (chunk < count) {
+      memcpy(buf + chunk, ring->events, (count - chunk) * sizeof (*buf));
+    }
+    if (ring_torn(ring, read_idx)) {
+      ++bench->torn;
+      continue;
+    }
+    for (j = 0; j < count; ++j) {
+      bench->errors += (u32) buf[j].ts_ns != read_idx + j;
+    }
+    read_idx += count;
+    bench->consumed += count;
+  }
+  bench->consumer_ns = ktime_get_ns() - start;
+  kfree(buf);
+  // Without a buffer nothing is consumed, the run is reported as failed
+  complete(&bench->done[1]);
+  return 0;
+}
+
+//! \brief Creates a benchmark thread, bound to a CPU if it is online
+static struct task_struct * bench_thread(int (*fn)(void *), struct bench * bench,
+                                         int cpu, char const * name) {
+  struct task_struct * task = kthread_create(fn, bench, "%s", name);
+
+  if (!IS_ERR(task)) {
+    if (cpu >= 0 && cpu < nr_cpu_ids && cpu_online(cpu)) {
+      kthread_bind(task, cpu);
+    }
+    wake_up_process(task);
+  }
+  return task;
+}
+
+//! \brief Returns events per second, in thousands
+static u64 bench_rate(u64 count, u64 ns) {
+  return ns ? div64_u64(count * 1000000ULL, ns) : 0;
+}
+
+//! \brief Runs the benchmark, the results go to the kernel log. A run in
+//! which the consumer missed or duplicated an event fails to load
+static int __init silenar_ring_bench_init(void) {
+  struct task_struct * producer, * consumer;
+  struct bench * bench;
+  int status;
+
+  if (!events || !batch || slots < 2) {
+    return -EINVAL;
+  }
+  bench = kzalloc(sizeof (*bench), GFP_KERNEL);
+  if (!bench) {
+    return -ENOMEM;
+  }
+  status = ring_init(&bench->ring,
+                     roundup_pow_of_two(min_t(uint, slots, 1U << 30)));
+  if (status) {
+    kfree(bench);
+    return status;
+  }
+  init_completion(&bench->go);
+  init_completion(&bench->done[0]);
+  init_completion(&bench->done[1]);
+
+  producer = bench_thread(bench_producer, bench, producer_cpu,
+                          "silenar_bench_p");
+  if (IS_ERR(producer)) {
+    status = PTR_ERR(producer);
+    goto out;
+  }
+  consumer = bench_thread(bench_consumer, bench, consumer_cpu,
+                          "silenar_bench_c");
+  if (IS_ERR(consumer)) {
+    // The producer runs on its own, nobody waits for its events
+    complete_all(&bench->go);
+    wait_for_completion(&bench->done[0]);
+    status = PTR_ERR(consumer);
+    goto out;
+  }
+  complete_all(&bench->go);
+  wait_for_completion(&bench->done[0]);
+  wait_for_completion(&bench->done[1]);
+
+  pr_info("silenar_ring_bench: %lu events, %u slots, batches of %u\n",
+          events, bench->ring.size, batch);
+  pr_info("silenar_ring_bench: producer %llu kev/s, consumer %llu kev/s\n",
+          bench_rate(events, bench->producer_ns),
+          bench_rate(bench->consumed, bench->consumer_ns));
+  pr_info("silenar_ring_bench: consumed %llu, lost %llu, torn %llu, "
+          "errors %llu\n", bench->consumed, bench->lost, bench->torn,
+          bench->errors);
+  if (bench->consumed + bench->lost != events || bench->errors) {
+    pr_err("silenar_ring_bench: the consumer did not get every event once\n");
+    status = -EIO;
+  }
+
+out:
+  ring_free(&bench->ring);
+  kfree(bench);
+  return status;
+}
+
+static void __exit silenar_ring_bench_exit(void) {
+}
+
+module_init(silenar_ring_bench_init);
+module_exit(silenar_ring_bench_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Throughput benchmark of the silenar event ring");
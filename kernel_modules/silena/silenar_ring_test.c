@@ -0,0 +1,249 @@
+//! \file silenar_ring_test.c
+//! \brief KUnit suite of the event ring, see silenar_ring.h
+//!
+//! Every case works on a small ring of RING_TEST_SIZE slots, driven from a
+//! single thread: the producer and the reader side are interleaved by hand
+//! to reach the empty, full, lapped and torn states. The write index can be
+//! placed anywhere, so the wrap of the indexes at 2^32 is tested too.
+
+#include <kunit/test.h>
+#include <linux/module.h>
+
+#include "silenar_ring.h"
+
+//! \def RING_TEST_SIZE
+//! \brief Number of slots of the ring under test
+#define RING_TEST_SIZE 16U
+
+//! \brief Allocates the ring of a case
+static int ring_test_init(struct kunit * test) {
+  struct silenar_ring * ring = kunit_kzalloc(test, sizeof (*ring), GFP_KERNEL);
+
+  KUNIT_ASSERT_NOT_NULL(test, ring);
+  KUNIT_ASSERT_EQ(test, ring_init(ring, RING_TEST_SIZE), 0);
+  test->priv = ring;
+  return 0;
+}
+
+//! \brief Releases the ring of a case
+static void ring_test_exit(struct kunit * test) {
+  ring_free(test->priv);
+}
+
+//! \brief Moves the write index of an empty ring, as if \a idx events had
+//! been produced already
+static void ring_test_seek(struct silenar_ring * ring, u32 idx) {
+  ring->header->write_idx = idx;
+}
+
+//! \brief Stores count events, the value of each event is its index
+static void ring_test_fill(struct silenar_ring * ring, u32 count) {
+  u32 j;
+
+  for (j = 0; j < count; ++j) {
+    u32 idx = ring->header->write_idx;
+    ring_push(ring, 1000ULL * idx, idx);
+  }
+}
+
+//! \brief The header describes the layout userspace maps
+static void ring_test_layout(struct kunit * test) {
+  struct silenar_ring * ring = test->priv;
+
+  KUNIT_EXPECT_EQ(test, ring->size, RING_TEST_SIZE);
+  KUNIT_EXPECT_EQ(test, ring->header->version, (u32) SILENAR_RING_VERSION);
+  KUNIT_EXPECT_EQ(test, ring->header->size, RING_TEST_SIZE);
+  KUNIT_EXPECT_EQ(test, ring->header->event_size,
+                  (u32) sizeof (struct silenar_event));
+  KUNIT_EXPECT_EQ(test, ring->header->data_offset, (u32) PAGE_SIZE);
+  KUNIT_EXPECT_PTR_EQ(test, (void *) ring->events, ring->mem + PAGE_SIZE);
+  // Same size, the memory and the indexes are kept
+  ring_test_fill(ring, 3);
+  KUNIT_EXPECT_EQ(test, ring_init(ring, RING_TEST_SIZE), 0);
+  KUNIT_EXPECT_EQ(test, ring_head(ring), 3U);
+}
+
+//! \brief A new ring has nothing to read and nothing lost
+static void ring_test_empty(struct kunit * test) {
+  struct silenar_ring * ring = test->priv;
+  u32 read_idx = 0;
+
+  KUNIT_EXPECT_EQ(test, ring_head(ring), 0U);
+  KUNIT_EXPECT_EQ(test, ring_available(ring, read_idx), 0U);
+  KUNIT_EXPECT_EQ(test, ring_backlog(ring, ring_head(ring), read_idx), 0U);
+  KUNIT_EXPECT_FALSE(test, ring_lapped(ring, ring_head(ring), read_idx));
+  KUNIT_EXPECT_EQ(test, ring_catch_up(ring, ring_head(ring), &read_idx), 0U);
+  KUNIT_EXPECT_EQ(test, read_idx, 0U);
+  KUNIT_EXPECT_FALSE(test, ring_torn(ring, read_idx));
+}
+
+//! \brief Events are stored in order, each in the slot of its index
+static void ring_test_push(struct kunit * test) {
+  struct silenar_ring * ring = test->priv;
+  u32 j;
+
+  for (j = 0; j < 5; ++j) {
+    KUNIT_EXPECT_EQ(test, ring_push(ring, 10 * j, 100 + j), j);
+  }
+  KUNIT_EXPECT_EQ(test, ring_head(ring), 5U);
+  KUNIT_EXPECT_EQ(test, ring_available(ring, 0), 5U);
+  KUNIT_EXPECT_EQ(test, ring_available(ring, 2), 3U);
+  for (j = 0; j < 5; ++j) {
+    KUNIT_EXPECT_EQ(test, ring_slot(ring, j)->ts_ns, 10ULL * j);
+    KUNIT_EXPECT_EQ(test, ring_slot(ring, j)->value, 100 + j);
+    KUNIT_EXPECT_EQ(test, ring_slot(ring, j)->flags, 0U);
+  }
+}
+
+//! \brief The ring holds size - 1 events safely, the next one laps the reader
+static void ring_test_full(struct kunit * test) {
+  struct silenar_ring * ring = test->priv;
+  u32 read_idx = 0;
+
+  ring_test_fill(ring, RING_TEST_SIZE - 1);
+  KUNIT_EXPECT_EQ(test, ring_available(ring, read_idx), RING_TEST_SIZE - 1);
+  KUNIT_EXPECT_FALSE(test, ring_lapped(ring, ring_head(ring), read_idx));
+  KUNIT_EXPECT_EQ(test, ring_catch_up(ring, ring_head(ring), &read_idx), 0U);
+
+  // The next event goes in the slot of read_idx, it may be in progress
+  ring_test_fill(ring, 1);
+  KUNIT_EXPECT_TRUE(test, ring_lapped(ring, ring_head(ring), read_idx));
+  KUNIT_EXPECT_EQ(test, ring_available(ring, read_idx), RING_TEST_SIZE - 1);
+  KUNIT_EXPECT_EQ(test, ring_catch_up(ring, ring_head(ring), &read_idx), 1U);
+  KUNIT_EXPECT_EQ(test, read_idx, 1U);
+  KUNIT_EXPECT_EQ(test, ring_slot(ring, read_idx)->value, 1U);
+  KUNIT_EXPECT_FALSE(test, ring_lapped(ring, ring_head(ring), read_idx));
+}
+
+//! \brief A reader lapped several times resumes from the oldest valid event,
+//! and the events it lost are counted once
+static void ring_test_overrun(struct kunit * test) {
+  struct silenar_ring * ring = test->priv;
+  u32 read_idx = 0, write_idx, lost, j;
+
+  ring_test_fill(ring, 3 * RING_TEST_SIZE + 5);
+  write_idx = ring_head(ring);
+  KUNIT_EXPECT_EQ(test, ring_backlog(ring, write_idx, read_idx), write_idx);
+  lost = ring_catch_up(ring, write_idx, &read_idx);
+  KUNIT_EXPECT_EQ(test, lost, write_idx - (RING_TEST_SIZE - 1));
+  KUNIT_EXPECT_EQ(test, read_idx, lost);
+  KUNIT_EXPECT_EQ(test, ring_available(ring, read_idx), RING_TEST_SIZE - 1);
+  for (j = read_idx; j != write_idx; ++j) {
+    KUNIT_EXPECT_EQ(test, ring_slot(ring, j)->value, j);
+  }
+  // Caught up, nothing more is lost
+  KUNIT_EXPECT_EQ(test, ring_catch_up(ring, write_idx, &read_idx), 0U);
+}
+
+//! \brief The free running indexes wrap at 2^32 without losing or repeating
+//! events
+static void ring_test_wrap(struct kunit * test) {
+  struct silenar_ring * ring = test->priv;
+  u32 read_idx = U32_MAX - 4, write_idx, lost, j;
+
+  ring_test_seek(ring, read_idx);
+  ring_test_fill(ring, 10);
+  write_idx = ring_head(ring);
+  KUNIT_EXPECT_EQ(test, write_idx, 5U);
+  KUNIT_EXPECT_EQ(test, ring_available(ring, read_idx), 10U);
+  KUNIT_EXPECT_EQ(test, ring_backlog(ring, write_idx, read_idx), 10U);
+  KUNIT_EXPECT_FALSE(test, ring_lapped(ring, write_idx, read_idx));
+  for (j = 0; j < 10; ++j) {
+    KUNIT_EXPECT_EQ(test, ring_slot(ring, read_idx + j)->value, read_idx + j);
+  }
+
+  // Lapped across the wrap
+  ring_test_fill(ring, RING_TEST_SIZE);
+  write_idx = ring_head(ring);
+  lost = ring_catch_up(ring, write_idx, &read_idx);
+  KUNIT_EXPECT_EQ(test, lost, 10U + RING_TEST_SIZE - (RING_TEST_SIZE - 1));
+  KUNIT_EXPECT_EQ(test, read_idx, write_idx - (RING_TEST_SIZE - 1));
+  KUNIT_EXPECT_EQ(test, ring_slot(ring, read_idx)->value, read_idx);
+}
+
+//! \brief A transfer is split where the slots wrap, not where the indexes do
+static void ring_test_contiguous(struct kunit * test) {
+  struct silenar_ring * ring = test->priv;
+
+  KUNIT_EXPECT_EQ(test, ring_contiguous(ring, 0, 5), 5U);
+  KUNIT_EXPECT_EQ(test, ring_contiguous(ring, 0, RING_TEST_SIZE),
+                  RING_TEST_SIZE);
+  KUNIT_EXPECT_EQ(test, ring_contiguous(ring, RING_TEST_SIZE - 3, 10), 3U);
+  KUNIT_EXPECT_EQ(test, ring_contiguous(ring, 5 * RING_TEST_SIZE + 12, 10),
+                  4U);
+  KUNIT_EXPECT_EQ(test, ring_contiguous(ring, U32_MAX, 10), 1U);
+  KUNIT_EXPECT_EQ(test, ring_contiguous(ring, 0, 0), 0U);
+}
+
+//! \brief A copy is torn once the producer reached its first slot
+static void ring_test_torn(struct kunit * test) {
+  struct silenar_ring * ring = test->priv;
+  u32 read_idx;
+
+  ring_test_fill(ring, 4);
+  read_idx = 1;
+  // Copy of [1, 4), the producer then stores events up to the slot before
+  ring_test_fill(ring, RING_TEST_SIZE - 4);
+  KUNIT_EXPECT_FALSE(test, ring_torn(ring, read_idx));
+  // The producer may now be writing the slot of read_idx
+  ring_test_fill(ring, 1);
+  KUNIT_EXPECT_TRUE(test, ring_torn(ring, read_idx));
+  KUNIT_EXPECT_FALSE(test, ring_torn(ring, read_idx + 1));
+
+  // Same across the wrap of the indexes
+  ring_test_seek(ring, U32_MAX - 1);
+  read_idx = U32_MAX - 1;
+  ring_test_fill(ring, RING_TEST_SIZE - 1);
+  KUNIT_EXPECT_FALSE(test, ring_torn(ring, read_idx));
+  ring_test_fill(ring, 1);
+  KUNIT_EXPECT_TRUE(test, ring_torn(ring, read_idx));
+}
+
+//! \brief Read indexes written by userspace are never trusted
+static void ring_test_bogus_cursor(struct kunit * test) {
+  struct silenar_ring * ring = test->priv;
+  u32 write_idx, read_idx;
+
+  ring_test_fill(ring, 8);
+  write_idx = ring_head(ring);
+  // Ahead of the producer
+  KUNIT_EXPECT_EQ(test, ring_backlog(ring, write_idx, write_idx + 1), 0U);
+  KUNIT_EXPECT_EQ(test, ring_backlog(ring, write_idx, U32_MAX / 2 + 9), 0U);
+  KUNIT_EXPECT_EQ(test, ring_available(ring, write_idx + 100),
+                  RING_TEST_SIZE - 1);
+  // Behind it, a slow reader
+  KUNIT_EXPECT_EQ(test, ring_backlog(ring, write_idx, 0), 8U);
+  KUNIT_EXPECT_EQ(test, ring_backlog(ring, write_idx, write_idx - 1000),
+                  1000U);
+  // A cursor ahead of the producer goes back to it, without any loss
+  read_idx = write_idx + 1;
+  KUNIT_EXPECT_EQ(test, ring_catch_up(ring, write_idx, &read_idx), 0U);
+  KUNIT_EXPECT_EQ(test, read_idx, write_idx);
+  read_idx = write_idx + 4 * RING_TEST_SIZE;
+  KUNIT_EXPECT_EQ(test, ring_catch_up(ring, write_idx, &read_idx), 0U);
+  KUNIT_EXPECT_EQ(test, read_idx, write_idx);
+}
+
+static struct kunit_case silenar_ring_cases[] = {
+  KUNIT_CASE(ring_test_layout),
+  KUNIT_CASE(ring_test_empty),
+  KUNIT_CASE(ring_test_push),
+  KUNIT_CASE(ring_test_full),
+  KUNIT_CASE(ring_test_overrun),
+  KUNIT_CASE(ring_test_wrap),
+  KUNIT_CASE(ring_test_contiguous),
+  KUNIT_CASE(ring_test_torn),
+  KUNIT_CASE(ring_test_bogus_cursor),
+  {}
+};
+
+static struct kunit_suite silenar_ring_suite = {
+  .name = "silenar_ring",
+  .init = ring_test_init,
+  .exit = ring_test_exit,
+  .test_cases = silenar_ring_cases,
+};
+kunit_test_suite(silenar_ring_suite);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("KUnit suite of the silenar event ring");
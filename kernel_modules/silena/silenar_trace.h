@@ -0,0 +1,113 @@
+//! \file silenar_trace.h
+//! \brief Tracepoints of the silenar hot path
+//!
+//! The events appear under /sys/kernel/tracing/events/silenar and cost a
+//! static branch while disabled. Every event carries the minor of the ADC.
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM silenar
+
+#if !defined(SILENAR_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define SILENAR_TRACE_H
+
+#include <linux/tracepoint.h>
+
+//! \brief The hard handler of RDY timestamped a conversion
+TRACE_EVENT(silenar_irq,
+  TP_PROTO(int minor, u64 ts_ns),
+  TP_ARGS(minor, ts_ns),
+  TP_STRUCT__entry(
+    __field(int, minor)
+    __field(u64, ts_ns)
+  ),
+  TP_fast_assign(
+    __entry->minor = minor;
+    __entry->ts_ns = ts_ns;
+  ),
+  TP_printk("minor=%d ts_ns=%llu", __entry->minor, __entry->ts_ns)
+);
+
+//! \brief The IRQ thread read the bus and acknowledged the conversion
+TRACE_EVENT(silenar_readout,
+  TP_PROTO(int minor, u32 value, bool accepted, u64 readout_ns, u64 ack_ns),
+  TP_ARGS(minor, value, accepted, readout_ns, ack_ns),
+  TP_STRUCT__entry(
+    __field(int, minor)
+    __field(u32, value)
+    __field(bool, accepted)
+    __field(u64, readout_ns)
+    __field(u64, ack_ns)
+  ),
+  TP_fast_assign(
+    __entry->minor      = minor;
+    __entry->value      = value;
+    __entry->accepted   = accepted;
+    __entry->readout_ns = readout_ns;
+    __entry->ack_ns     = ack_ns;
+  ),
+  TP_printk("minor=%d value=%u accepted=%d readout_ns=%llu ack_ns=%llu",
+            __entry->minor, __entry->value, __entry->accepted,
+            __entry->readout_ns, __entry->ack_ns)
+);
+
+//! \brief The event of index write_idx overwrote an event the slowest reader
+//! did not consume
+TRACE_EVENT(silenar_ring_full,
+  TP_PROTO(int minor, u32 write_idx, u32 size),
+  TP_ARGS(minor, write_idx, size),
+  TP_STRUCT__entry(
+    __field(int, minor)
+    __field(u32, write_idx)
+    __field(u32, size)
+  ),
+  TP_fast_assign(
+    __entry->minor     = minor;
+    __entry->write_idx = write_idx;
+    __entry->size      = size;
+  ),
+  TP_printk("minor=%d write_idx=%u size=%u", __entry->minor,
+            __entry->write_idx, __entry->size)
+);
+
+//! \brief The readers were woken after batch events were stored
+TRACE_EVENT(silenar_wake,
+  TP_PROTO(int minor, u32 batch),
+  TP_ARGS(minor, batch),
+  TP_STRUCT__entry(
+    __field(int, minor)
+    __field(u32, batch)
+  ),
+  TP_fast_assign(
+    __entry->minor = minor;
+    __entry->batch = batch;
+  ),
+  TP_printk("minor=%d batch=%u", __entry->minor, __entry->batch)
+);
+
+//! \brief A read copied events out of the ring
+TRACE_EVENT(silenar_copy,
+  TP_PROTO(int minor, u32 read_idx, u32 events, size_t bytes),
+  TP_ARGS(minor, read_idx, events, bytes),
+  TP_STRUCT__entry(
+    __field(int, minor)
+    __field(u32, read_idx)
+    __field(u32, events)
+    __field(size_t, bytes)
+  ),
+  TP_fast_assign(
+    __entry->minor    = minor;
+    __entry->read_idx = read_idx;
+    __entry->events   = events;
+    __entry->bytes    = bytes;
+  ),
+  TP_printk("minor=%d read_idx=%u events=%u bytes=%zu", __entry->minor,
+            __entry->read_idx, __entry->events, __entry->bytes)
+);
+
+#endif // SILENAR_TRACE_H
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE silenar_trace
+#include <trace/define_trace.h>
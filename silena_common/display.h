@@ -0,0 +1,272 @@
+/****************************************************************************
+ * Copyright (C) 2021 by Rodrigo Torres                                     *
+ *                                                                          *
+ *   This program free software: you can redistribute it and/or modify it   *
+ *   under the terms of the GNU Lesser General Public License as published  *
+ *   by the Free Software Foundation, either version 3 of the License, or   *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   This program is distributed in the hope that it will be useful,        *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU Lesser General Public License for more details.                    *
+ *                                                                          *
+ *   You should have received a copy of the GNU Lesser General Public       *
+ *   License along with this program.                                       *
+ ***************************************************************************/
+
+//! \file display.h
+//! \brief A display thread that plots histogram snapshots at a fixed frame
+//! rate, independent of the event rate
+//!
+//! The acquisition thread keeps filling its histogram and publishes
+//! snapshots of it with Display_Publish(). Three snapshot buffers rotate between
+//! the two threads without locks: the acquisition thread writes the back
+//! buffer, the display thread plots the front buffer, and the middle buffer
+//! is swapped atomically with either of them. A slow gnuplot only delays the
+//! next frame, never the acquisition.
+
+#ifndef DISPLAY_H
+#define DISPLAY_H
+
+#include "gnuplot.h"
+#include "histo.h"
+#include "peaks.h"
+#include "rate.h"
+#include "utility.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+//! \def DISPLAY_FRESH
+//! \brief Flag of Display_Typedef.middle, set while the middle buffer holds a
+//! snapshot the display thread did not plot yet
+#define DISPLAY_FRESH 4
+//! \def DISPLAY_CURVE
+//! \brief Points of the fitted curve drawn over each peak
+#define DISPLAY_CURVE 64
+//! \def DISPLAY_LABEL
+//! \brief Tag of the gnuplot label of the first peak
+#define DISPLAY_LABEL 10
+
+typedef struct {
+	FILE * plot;			///< The gnuplot pipe, only used by the display thread
+	int points;				///< Number of channels of the histograms
+	int period_ms;			///< Time between two frames
+	uint64_t * buffers[3];	///< The snapshot buffers
+	Rate_Summary rates[3];	///< The rates published with each snapshot
+	bool with_rates[3];		///< The snapshot came with rates to label it
+	bool with_peaks;		///< Search and fit the peaks of each frame
+	Peaks_Typedef peaks;	///< The peaks, only used by the display thread
+	double curve_x [PEAKS_MAX * (DISPLAY_CURVE + 1)];	///< Fitted curves
+	double curve_y [PEAKS_MAX * (DISPLAY_CURVE + 1)];	///< Fitted curves
+	int back;				///< Buffer owned by the acquisition thread
+	int front;				///< Buffer owned by the display thread
+	atomic_int middle;		///< Buffer in between, with the DISPLAY_FRESH flag
+	atomic_bool run;		///< Cleared to stop the display thread
+	pthread_t thread;		///< The display thread
+} Display_Typedef;
+
+//! \brief Allocates the snapshot buffers and starts the display thread
+//!
+//! \param display is the display to start
+//! \param plot is a configured gnuplot pipe, see GNUPlot_Configure()
+//! \param points is the number of channels of the histograms
+//! \param fps is the number of frames per second
+//! \param fwhm is the expected width of the peaks to fit in each frame, 0 to
+//! fit none
+//!
+//! \return 0 on success, -1 otherwise
+static int Display_Start(Display_Typedef * display, FILE * plot, int points,
+		int fps, double fwhm);
+
+//! \brief Publishes a snapshot of the histogram of the acquisition thread
+//!
+//! The snapshot is only taken when the display thread took the previous one,
+//! so at most once per frame.
+//!
+//! \param display is a started display
+//! \param histo is the histogram, \a points channels
+//! \param rates are the rates shown with the histogram, NULL if none
+static void Display_Publish(Display_Typedef * display, Histo_Typedef * histo,
+		Rate_Summary const * rates);
+
+//! \brief Stops the display thread, plots the final histogram, prints the
+//! final fits of the peaks and releases the snapshot buffers
+//!
+//! \param display is a started display
+//! \param histo is the final histogram, or NULL to skip the last frame
+//! \param rates are the final rates, NULL if none
+static void Display_Stop(Display_Typedef * display, Histo_Typedef * histo,
+		Rate_Summary const * rates);
+
+//! \brief Fits the peaks of a snapshot and plots it with the fitted curves
+//! and a label over each peak
+//!
+//! \param display is the display
+//! \param buffer is the snapshot to plot
+static void Display_Peaks(Display_Typedef * display, int buffer) {
+	Peaks_Typedef * peaks = &display->peaks;
+	char label [128];
+	int j, k, n = 0;
+
+	Peaks_Update(peaks, display->buffers[buffer]);
+	for (j = 0; j < PEAKS_MAX; ++j) {
+		Peaks_Fit const * fit = &peaks->peaks[j];
+		if (j >= peaks->npeaks || !fit->valid) {
+			GNUPlot_LabelAt(display->plot, DISPLAY_LABEL + j, 0, 0, NULL);
+			continue;
+		}
+		for (k = 0; k < DISPLAY_CURVE; ++k) {
+			double const x = fit->lo + (fit->hi - fit->lo) * k / (DISPLAY_CURVE - 1.0);
+			display->curve_x[n] = x;
+			display->curve_y[n++] = Peaks_Model(fit, x);
+		}
+		display->curve_x[n] = display->curve_y[n] = NAN;
+		++n;
+		snprintf(label, sizeof (label), "%.1f\\nFWHM %.1f\\nA %.0f",
+				fit->centroid, fit->fwhm, fit->area);
+		GNUPlot_LabelAt(display->plot, DISPLAY_LABEL + j, fit->centroid,
+				1.15 * Peaks_Model(fit, fit->centroid), label);
+	}
+	GNUPlot_PlotCurves(display->plot, display->buffers[buffer], display->points,
+			display->curve_x, display->curve_y, n);
+}
+
+//! \brief Plots a frame
+//!
+//! \param display is the display
+//! \param buffer is the snapshot to plot
+static void Display_Frame(Display_Typedef * display, int buffer) {
+	Rate_Summary const * r = &display->rates[buffer];
+	char label [256];
+
+	if (display->with_rates[buffer]) {
+		snprintf(label, sizeof (label),
+				"%.0f / %.0f / %.0f ev/s over 1 / 10 / 60 s\\n"
+				"dead time %.1f us, %.1f %%, true rate %.0f ev/s",
+				r->rate[0], r->rate[1], r->rate[2], r->dead_us,
+				100.0 * r->dead_fraction, r->true_rate);
+		GNUPlot_Label(display->plot, label);
+	}
+	if (display->with_peaks) {
+		Display_Peaks(display, buffer);
+		return;
+	}
+	GNUPlot_Plot(display->plot, display->buffers[buffer], display->points);
+}
+
+//! \brief Body of the display thread
+//!
+//! \param arg is a pointer to the Display_Typedef
+static void * Display_Thread(void * arg) {
+	Display_Typedef * display = arg;
+	struct timespec period = {
+		.tv_sec  = display->period_ms / 1000,
+		.tv_nsec = (display->period_ms % 1000) * 1000000L
+	};
+
+	while (atomic_load(&display->run)) {
+		nanosleep(&period, NULL);
+		if (!(atomic_load(&display->middle) & DISPLAY_FRESH)) {
+			continue; // Nothing new since the last frame
+		}
+		// Take the fresh snapshot, give back the one already plotted
+		display->front = atomic_exchange(&display->middle, display->front) &
+				~DISPLAY_FRESH;
+		Display_Frame(display, display->front);
+	}
+	return NULL;
+}
+
+static int Display_Start(Display_Typedef * display, FILE * plot, int points,
+		int fps, double fwhm) {
+	int j;
+
+	memset(display, 0, sizeof (*display));
+	display->plot      = plot;
+	display->points    = points;
+	display->period_ms = 1000 / (fps > 0 ? fps : 1);
+	for (j = 0; j < 3; ++j) {
+		display->buffers[j] = calloc(points, sizeof (uint64_t));
+		if (display->buffers[j] == NULL) {
+			PRINT_STD_LIBERROR("calloc");
+			Display_Stop(display, NULL, NULL);
+			return -1;
+		}
+	}
+	if (fwhm > 0.0) {
+		if (Peaks_Init(&display->peaks, points, fwhm) == -1) {
+			Display_Stop(display, NULL, NULL);
+			return -1;
+		}
+		display->with_peaks = true;
+	}
+	display->back  = 0;
+	display->front = 1;
+	atomic_init(&display->middle, 2);
+	atomic_init(&display->run, true);
+
+	// The display thread inherits a blocked mask, so that the signals are
+	// delivered to the acquisition thread. The clients install their
+	// handlers without SA_RESTART, so the blocking read returns EINTR
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	errno = pthread_create(&display->thread, NULL, &Display_Thread, display);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (errno) {
+		PRINT_STD_LIBERROR("pthread_create");
+		atomic_store(&display->run, false);
+		Display_Stop(display, NULL, NULL);
+		return -1;
+	}
+	return 0;
+}
+
+static void Display_Publish(Display_Typedef * display, Histo_Typedef * histo,
+		Rate_Summary const * rates) {
+	if (atomic_load(&display->middle) & DISPLAY_FRESH) {
+		return; // The display thread did not take the last snapshot yet
+	}
+	// The rates travel with the snapshot, the exchange publishes both
+	Histo_Snapshot(histo, display->buffers[display->back], false);
+	display->with_rates[display->back] = rates != NULL;
+	if (rates != NULL) {
+		display->rates[display->back] = *rates;
+	}
+	display->back = atomic_exchange(&display->middle,
+			display->back | DISPLAY_FRESH) & ~DISPLAY_FRESH;
+}
+
+static void Display_Stop(Display_Typedef * display, Histo_Typedef * histo,
+		Rate_Summary const * rates) {
+	int j;
+
+	if (atomic_exchange(&display->run, false)) {
+		pthread_join(display->thread, NULL);
+		if (histo != NULL) {
+			Histo_Snapshot(histo, display->buffers[display->back], false);
+			display->with_rates[display->back] = rates != NULL;
+			if (rates != NULL) {
+				display->rates[display->back] = *rates;
+			}
+			Display_Frame(display, display->back);
+			Peaks_Print(&display->peaks, stdout);
+		}
+	}
+	Peaks_Free(&display->peaks);
+	for (j = 0; j < 3; ++j) {
+		free(display->buffers[j]);
+		display->buffers[j] = NULL;
+	}
+}
+
+#endif // DISPLAY_H
@@ -27,6 +27,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <inttypes.h>
 #include <stdint.h>
 #include <unistd.h>
 
@@ -59,7 +60,34 @@ static FILE * GNUPlot_Configure(GNUPlot_ParamsTypedef * params);
 //! \param plot
 //! \param data
 //! \param points
-static void GNUPlot_Plot(FILE * plot, int16_t const * data, int const points);
+static void GNUPlot_Plot(FILE * plot, uint64_t const * data, int const points);
+
+//! \brief Plots a histogram with curves drawn over it
+//!
+//! \param plot
+//! \param data
+//! \param points
+//! \param x are the abscissas of the curves
+//! \param y are the ordinates of the curves, NAN ends a curve
+//! \param n is the number of points of the curves
+static void GNUPlot_PlotCurves(FILE * plot, uint64_t const * data,
+		int const points, double const * x, double const * y, int const n);
+
+//! \brief Sets or removes a label at a position of the plot
+//!
+//! \param plot
+//! \param tag identifies the label, above 1
+//! \param x
+//! \param y
+//! \param text is the text, NULL to remove the label
+static void GNUPlot_LabelAt(FILE * plot, int tag, double x, double y,
+		char const * text);
+
+//! \brief Sets the text drawn in the top right corner of the next plots
+//!
+//! \param plot
+//! \param text is the text, lines are separated by "\\n"
+static void GNUPlot_Label(FILE * plot, char const * text);
 
 static FILE * GNUPlot_Configure(GNUPlot_ParamsTypedef * params) {
 	if(params == NULL) {
@@ -106,17 +134,54 @@ static FILE * GNUPlot_Configure(GNUPlot_ParamsTypedef * params) {
 
 
 
-static void GNUPlot_Plot(FILE * plot, int16_t const * data, int const points) {
+static void GNUPlot_Plot(FILE * plot, uint64_t const * data, int const points) {
 	if (points == 1) {
 		return; // Avoid GNUplot complaints
 	}
 
 	fprintf(plot, " plot '-'\n");
 	for (int j = 0; j < points; ++j) {
-		fprintf(plot, " %d %d\n", j, data[j]);
+		fprintf(plot, " %d %" PRIu64 "\n", j, data[j]);
+	}
+	fprintf(plot, "e\n");
+	fflush(plot);
+}
+
+static void GNUPlot_PlotCurves(FILE * plot, uint64_t const * data,
+		int const points, double const * x, double const * y, int const n) {
+	if (n == 0) {
+		GNUPlot_Plot(plot, data, points);
+		return;
+	}
+	fprintf(plot, " plot '-' notitle, '-' with lines notitle\n");
+	for (int j = 0; j < points; ++j) {
+		fprintf(plot, " %d %" PRIu64 "\n", j, data[j]);
+	}
+	fprintf(plot, "e\n");
+	for (int j = 0; j < n; ++j) {
+		if (y[j] != y[j]) { // A blank line breaks the curve
+			fprintf(plot, "\n");
+		} else {
+			fprintf(plot, " %g %g\n", x[j], y[j]);
+		}
 	}
 	fprintf(plot, "e\n");
 	fflush(plot);
 }
 
+static void GNUPlot_LabelAt(FILE * plot, int tag, double x, double y,
+		char const * text) {
+	if (text == NULL) {
+		fprintf(plot, " unset label %d\n", tag);
+	} else {
+		fprintf(plot, " set label %d \"%s\" at %g, %g center front\n", tag,
+				text, x, y);
+	}
+}
+
+static void GNUPlot_Label(FILE * plot, char const * text) {
+	fprintf(plot, " set label 1 \"%s\" at graph 0.98, graph 0.95 right front\n",
+			text);
+}
+
 #endif // daq_setup.h
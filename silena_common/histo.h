@@ -0,0 +1,241 @@
+/****************************************************************************
+ * Copyright (C) 2021 by Rodrigo Torres                                     *
+ *                                                                          *
+ *   This program free software: you can redistribute it and/or modify it   *
+ *   under the terms of the GNU Lesser General Public License as published  *
+ *   by the Free Software Foundation, either version 3 of the License, or   *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   This program is distributed in the hope that it will be useful,        *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU Lesser General Public License for more details.                    *
+ *                                                                          *
+ *   You should have received a copy of the GNU Lesser General Public       *
+ *   License along with this program.                                       *
+ ***************************************************************************/
+
+//! \file histo.h
+//! \brief A histogram of ADC values with 64-bit counters, shared by the
+//! Silena clients
+//!
+//! The counters are split in shards, one per filling thread. Only the owner
+//! of a shard writes its counters, which are plain 64-bit integers: no atomic
+//! operation, so no libatomic on 32-bit ARM. The owner holds the lock of its
+//! shard for a whole batch, uncontended unless a snapshot is being taken.
+//! Histo_Snapshot() takes the locks of all the shards before merging them, so
+//! a snapshot is a consistent cut between two batches of every thread, and a
+//! counter is never read half updated. The counters are never cleared: a
+//! reset moves the baseline that snapshots subtract, so an event is counted
+//! either before or after a reset, never lost and never twice.
+
+#ifndef HISTO_H
+#define HISTO_H
+
+#include "utility.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//! \def HISTO_UNROLL
+//! \brief Number of values incremented by each iteration of the fill kernel
+#define HISTO_UNROLL 4
+//! \def HISTO_PREFETCH
+//! \brief Distance, in values, between the counter being incremented and the
+//! one being prefetched. A spectrum of 8192 channels does not fit the L1 cache
+#define HISTO_PREFETCH 16
+//! \def HISTO_CACHELINE
+//! \brief Alignment of the shards, so that two threads never share a line
+#define HISTO_CACHELINE 64
+
+//! \brief Lock of one shard, alone in its cache line
+typedef struct {
+	_Alignas(HISTO_CACHELINE) pthread_mutex_t mutex;
+} Histo_Lock;
+
+typedef struct {
+	int channels;			///< Number of channels
+	int shards;				///< Number of shards, one per filling thread
+	size_t stride;			///< Counters per shard, channels plus overflow
+	uint64_t * counts;		///< The shards, one after the other
+	Histo_Lock * locks;		///< The locks of the shards
+	uint64_t * baseline;	///< Merged counts at the last reset
+	uint64_t overflow_baseline;	///< Out of range values at the last reset
+} Histo_Typedef;
+
+//! \brief Allocates a zeroed histogram
+//!
+//! \param histo is the histogram to initialize
+//! \param channels is the number of channels, values from 0 to channels - 1
+//! \param shards is the number of threads that fill the histogram
+//!
+//! \return 0 on success, -1 otherwise
+static int Histo_Init(Histo_Typedef * histo, int channels, int shards);
+
+//! \brief Releases the memory of a histogram
+//!
+//! \param histo is the histogram, initialized or zeroed
+static void Histo_Free(Histo_Typedef * histo);
+
+//! \brief Increments the channels of a batch of values. Values out of range
+//! are counted apart, see Histo_Snapshot()
+//!
+//! \param histo is the histogram
+//! \param shard is the shard of the calling thread, no other thread may fill
+//! it at the same time
+//! \param values points to the first value
+//! \param stride is the distance in bytes between two values, so that the
+//! value field of an array of events can be used in place
+//! \param count is the number of values
+static void Histo_Fill(Histo_Typedef * histo, int shard,
+		uint32_t const * values, size_t stride, size_t count);
+
+//! \brief Merges the shards into an array of counts, optionally resetting the
+//! histogram. Can be called while the shards are filled, but only by one
+//! thread at a time. The fills wait for the merge to end
+//!
+//! \param histo is the histogram
+//! \param counts receives the counts since the last reset, one per channel
+//! \param reset if true, the next snapshot starts from zero
+//!
+//! \return the number of values out of range since the last reset
+static uint64_t Histo_Snapshot(Histo_Typedef * histo, uint64_t * counts,
+		bool reset);
+
+static int Histo_Init(Histo_Typedef * histo, int channels, int shards) {
+	size_t size;
+	int s;
+
+	memset(histo, 0, sizeof (*histo));
+	if (channels <= 0 || shards <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	histo->channels = channels;
+	histo->shards   = shards;
+	// One more counter for the overflow, rounded up to whole cache lines
+	histo->stride = (channels + 1 + HISTO_CACHELINE / sizeof (uint64_t) -
+			1) & ~(HISTO_CACHELINE / sizeof (uint64_t) - 1);
+
+	size = histo->stride * shards * sizeof (uint64_t);
+	histo->counts = aligned_alloc(HISTO_CACHELINE, size);
+	histo->locks = aligned_alloc(HISTO_CACHELINE, shards * sizeof (Histo_Lock));
+	histo->baseline = calloc(channels, sizeof (uint64_t));
+	if (histo->counts == NULL || histo->locks == NULL ||
+			histo->baseline == NULL) {
+		PRINT_STD_LIBERROR("aligned_alloc");
+		Histo_Free(histo);
+		return -1;
+	}
+	memset(histo->counts, 0, size);
+	for (s = 0; s < shards; ++s) {
+		pthread_mutex_init(&histo->locks[s].mutex, NULL);
+	}
+	return 0;
+}
+
+static void Histo_Free(Histo_Typedef * histo) {
+	int s;
+
+	if (histo->locks != NULL && histo->counts != NULL &&
+			histo->baseline != NULL) {
+		for (s = 0; s < histo->shards; ++s) {
+			pthread_mutex_destroy(&histo->locks[s].mutex);
+		}
+	}
+	free(histo->counts);
+	free(histo->locks);
+	free(histo->baseline);
+	histo->counts   = NULL;
+	histo->locks    = NULL;
+	histo->baseline = NULL;
+}
+
+//! \brief Returns the counter of a value, the overflow counter if the value
+//! is out of range
+//!
+//! \param counts is the shard
+//! \param channels is the number of channels
+//! \param value is the value
+static inline uint64_t * Histo_Bin(uint64_t * counts,
+		int channels, uint32_t value) {
+	return counts + (value < (uint32_t) channels ? value : (uint32_t) channels);
+}
+
+static void Histo_Fill(Histo_Typedef * histo, int shard,
+		uint32_t const * values, size_t stride, size_t count) {
+	uint64_t * counts = histo->counts + shard * histo->stride;
+	char const * v = (char const *) values;
+	int const channels = histo->channels;
+	size_t j = 0;
+
+	pthread_mutex_lock(&histo->locks[shard].mutex);
+#define HISTO_VALUE(_j) (*(uint32_t const *) (v + (_j) * stride))
+	// The values of one iteration are loaded before any counter is touched.
+	// Equal values in a row increment the same counter one after the other,
+	// so conflicts need no special handling in a scalar kernel
+	for (; j + HISTO_UNROLL + HISTO_PREFETCH <= count; j += HISTO_UNROLL) {
+		uint32_t const v0 = HISTO_VALUE(j);
+		uint32_t const v1 = HISTO_VALUE(j + 1);
+		uint32_t const v2 = HISTO_VALUE(j + 2);
+		uint32_t const v3 = HISTO_VALUE(j + 3);
+
+		__builtin_prefetch(Histo_Bin(counts, channels,
+				HISTO_VALUE(j + HISTO_PREFETCH)), 1);
+		__builtin_prefetch(Histo_Bin(counts, channels,
+				HISTO_VALUE(j + HISTO_PREFETCH + 1)), 1);
+		__builtin_prefetch(Histo_Bin(counts, channels,
+				HISTO_VALUE(j + HISTO_PREFETCH + 2)), 1);
+		__builtin_prefetch(Histo_Bin(counts, channels,
+				HISTO_VALUE(j + HISTO_PREFETCH + 3)), 1);
+
+		++*Histo_Bin(counts, channels, v0);
+		++*Histo_Bin(counts, channels, v1);
+		++*Histo_Bin(counts, channels, v2);
+		++*Histo_Bin(counts, channels, v3);
+	}
+	for (; j < count; ++j) {
+		++*Histo_Bin(counts, channels, HISTO_VALUE(j));
+	}
+#undef HISTO_VALUE
+	pthread_mutex_unlock(&histo->locks[shard].mutex);
+}
+
+static uint64_t Histo_Snapshot(Histo_Typedef * histo, uint64_t * counts,
+		bool reset) {
+	uint64_t overflow = 0;
+	int j, s;
+
+	// The shards are locked in order, and a filling thread only takes its own
+	for (s = 0; s < histo->shards; ++s) {
+		pthread_mutex_lock(&histo->locks[s].mutex);
+	}
+	for (j = 0; j <= histo->channels; ++j) {
+		uint64_t sum = 0;
+		for (s = 0; s < histo->shards; ++s) {
+			sum += histo->counts[s * histo->stride + j];
+		}
+		if (j == histo->channels) {
+			overflow = sum - histo->overflow_baseline;
+			if (reset) {
+				histo->overflow_baseline = sum;
+			}
+			break;
+		}
+		counts[j] = sum - histo->baseline[j];
+		if (reset) {
+			histo->baseline[j] = sum;
+		}
+	}
+	for (s = histo->shards - 1; s >= 0; --s) {
+		pthread_mutex_unlock(&histo->locks[s].mutex);
+	}
+	return overflow;
+}
+
+#endif // HISTO_H
@@ -0,0 +1,95 @@
+/****************************************************************************
+ * Copyright (C) 2021 by Rodrigo Torres                                     *
+ *                                                                          *
+ *   This program free software: you can redistribute it and/or modify it   *
+ *   under the terms of the GNU Lesser General Public License as published  *
+ *   by the Free Software Foundation, either version 3 of the License, or   *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   This program is distributed in the hope that it will be useful,        *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU Lesser General Public License for more details.                    *
+ *                                                                          *
+ *   You should have received a copy of the GNU Lesser General Public       *
+ *   License along with this program.                                       *
+ ***************************************************************************/
+
+//! \file listmode.h
+//! \brief Layout of the list-mode files, the raw events of a run on disk
+//!
+//! A run is recorded in one or more files named <prefix>_NNNN.slm. Each file
+//! starts with a struct listmode_run, padded to LISTMODE_RUN_SIZE bytes,
+//! followed by blocks of LISTMODE_BLOCK_SIZE bytes. A block starts with a
+//! struct listmode_block, the index record of the block, followed by its
+//! events and zero padding. Every offset and size is a multiple of 4096, so
+//! the files can be written with O_DIRECT and mapped block by block.
+//!
+//! All fields are in the byte order of the recording machine.
+
+#ifndef LISTMODE_H
+#define LISTMODE_H
+
+#include "silenar.h"
+
+#include <stdint.h>
+
+//! \def LISTMODE_RUN_MAGIC
+//! \brief First four bytes of a list-mode file, "SLMR" in memory
+#define LISTMODE_RUN_MAGIC 0x524D4C53U
+//! \def LISTMODE_BLOCK_MAGIC
+//! \brief First four bytes of each block, "SLMB" in memory
+#define LISTMODE_BLOCK_MAGIC 0x424D4C53U
+//! \def LISTMODE_VERSION
+//! \brief Bumped on any change of the layout
+#define LISTMODE_VERSION 1
+
+//! \def LISTMODE_RUN_SIZE
+//! \brief Size of the run header in the file, the first block follows it
+#define LISTMODE_RUN_SIZE 4096
+//! \def LISTMODE_BLOCK_SIZE
+//! \brief Size of a block, header included
+#define LISTMODE_BLOCK_SIZE (1 << 20)
+//! \def LISTMODE_BLOCK_EVENTS
+//! \brief Largest number of events in a block
+#define LISTMODE_BLOCK_EVENTS \
+	((LISTMODE_BLOCK_SIZE - sizeof (struct listmode_block)) / \
+	 sizeof (struct event))
+//! \def LISTMODE_SUFFIX
+//! \brief Extension of the list-mode files
+#define LISTMODE_SUFFIX ".slm"
+
+//! \brief struct listmode_run starts each file of a run
+struct listmode_run {
+	uint32_t magic;			///< LISTMODE_RUN_MAGIC
+	uint16_t version;		///< LISTMODE_VERSION
+	uint16_t run_size;		///< LISTMODE_RUN_SIZE
+	uint32_t block_size;	///< LISTMODE_BLOCK_SIZE
+	uint32_t event_format;	///< SILENAR_FORMAT_LEGACY, struct event records
+	uint32_t event_size;	///< Size in bytes of one event
+	uint32_t file_index;	///< Position of the file in the run, from 0
+	int64_t start_ns;		///< Start of the run, CLOCK_REALTIME
+	char device[64];		///< Path of the char device, null terminated
+};
+
+//! \brief struct listmode_block is the index record at the start of a block.
+//! Reading the headers alone gives the time range and the event numbers of
+//! each block, without touching the events
+struct listmode_block {
+	uint32_t magic;			///< LISTMODE_BLOCK_MAGIC
+	uint32_t events;		///< Events stored in the block
+	uint64_t sequence;		///< Position of the block in the run, from 0
+	uint64_t first_event;	///< Position of the first event in the run
+	uint64_t lost;			///< Events dropped by the recorder before the
+							///< block, since the previous one
+	int64_t first_us;		///< Timestamp of the first event, microseconds
+	int64_t last_us;		///< Timestamp of the last event, microseconds
+	uint64_t reserved[2];	///< Zero
+};
+
+_Static_assert(sizeof (struct listmode_run) <= LISTMODE_RUN_SIZE,
+		"the run header does not fit its reserved space");
+_Static_assert(sizeof (struct listmode_block) == 64,
+		"the block header changed size, bump LISTMODE_VERSION");
+
+#endif // LISTMODE_H
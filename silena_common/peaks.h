@@ -0,0 +1,511 @@
+/****************************************************************************
+ * Copyright (C) 2021 by Rodrigo Torres                                     *
+ *                                                                          *
+ *   This program free software: you can redistribute it and/or modify it   *
+ *   under the terms of the GNU Lesser General Public License as published  *
+ *   by the Free Software Foundation, either version 3 of the License, or   *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   This program is distributed in the hope that it will be useful,        *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU Lesser General Public License for more details.                    *
+ *                                                                          *
+ *   You should have received a copy of the GNU Lesser General Public       *
+ *   License along with this program.                                       *
+ ***************************************************************************/
+
+//! \file peaks.h
+//! \brief Peak search and Gaussian fits on a live spectrum
+//!
+//! Peaks are searched with a smoothed second derivative: the spectrum is
+//! convolved with a zero-sum kernel shaped as the second derivative of a
+//! Gaussian of the expected width, which cancels a linear background, and
+//! the response is compared to its own statistical error. Each peak found is
+//! fitted with a Gaussian over a linear background by Levenberg-Marquardt,
+//! with Poisson weights.
+//!
+//! Peaks_Update() is meant to run at every refresh of the display. The
+//! search runs again only when the spectrum grew by PEAKS_REFIT since the
+//! last one, and a peak is fitted again only when the counts in its window
+//! changed by PEAKS_REFIT since its last fit, starting from the previous
+//! result. As the spectrum accumulates, the work per refresh falls quickly.
+
+#ifndef PEAKS_H
+#define PEAKS_H
+
+#include "utility.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//! \def PEAKS_MAX
+//! \brief Largest number of peaks, the most significant are kept
+#define PEAKS_MAX 16
+//! \def PEAKS_THRESHOLD
+//! \brief Significance of the search response, in standard deviations, that
+//! makes a peak
+#define PEAKS_THRESHOLD 5.0
+//! \def PEAKS_REFIT
+//! \brief Relative change of the counts that triggers a new search or fit
+#define PEAKS_REFIT 0.05
+//! \def PEAKS_WINDOW
+//! \brief Half width of the fit window, in sigmas of the peak
+#define PEAKS_WINDOW 3.0
+//! \def PEAKS_ITERATIONS
+//! \brief Largest number of Levenberg-Marquardt steps per fit
+#define PEAKS_ITERATIONS 30
+//! \def PEAKS_PARAMS
+//! \brief Amplitude, centroid, sigma, background level and slope
+#define PEAKS_PARAMS 5
+
+//! \brief A fitted peak
+typedef struct {
+	int lo;					///< First channel of the fit window
+	int hi;					///< Last channel of the fit window
+	double p [PEAKS_PARAMS];	///< Fit parameters, see Peaks_Model()
+	double counts;			///< Counts in the window at the last fit
+	bool valid;				///< The last fit converged
+	double centroid;		///< Centroid, channels
+	double centroid_err;	///< Error of the centroid
+	double fwhm;			///< Full width at half maximum, channels
+	double area;			///< Net counts of the peak
+	double area_err;		///< Error of the area
+	double chi2;			///< Reduced chi square of the fit
+} Peaks_Fit;
+
+typedef struct {
+	int channels;			///< Channels of the spectrum
+	double sigma;			///< Sigma of the search kernel, channels
+	int half;				///< Half width of the search kernel
+	double * kernel;		///< The search kernel, 2 * half + 1 taps
+	double * response;		///< Significance of the response per channel
+	double searched;		///< Counts of the spectrum at the last search
+	int npeaks;				///< Peaks found
+	Peaks_Fit peaks [PEAKS_MAX];	///< The peaks, by channel
+	uint64_t searches;		///< Searches run
+	uint64_t fits;			///< Fits run
+} Peaks_Typedef;
+
+//! \brief Allocates the search buffers
+//!
+//! \param peaks is the state to initialize
+//! \param channels is the number of channels of the spectra
+//! \param fwhm is the expected width of the peaks, in channels
+//!
+//! \return 0 on success, -1 otherwise
+static int Peaks_Init(Peaks_Typedef * peaks, int channels, double fwhm);
+
+//! \brief Releases the search buffers
+//!
+//! \param peaks is the state, initialized or zeroed
+static void Peaks_Free(Peaks_Typedef * peaks);
+
+//! \brief Searches and fits the peaks of a spectrum, reusing the previous
+//! results where the spectrum did not change enough
+//!
+//! \param peaks is the state
+//! \param counts is the spectrum, \a channels counts
+//!
+//! \return the number of fits run
+static int Peaks_Update(Peaks_Typedef * peaks, uint64_t const * counts);
+
+//! \brief Returns the value of the fitted model in a channel
+//!
+//! \param fit is the peak
+//! \param x is the channel
+static double Peaks_Model(Peaks_Fit const * fit, double x);
+
+//! \brief Prints the fitted peaks, one per line
+//!
+//! \param peaks is the state
+//! \param out is the stream
+static void Peaks_Print(Peaks_Typedef const * peaks, FILE * out);
+
+static int Peaks_Init(Peaks_Typedef * peaks, int channels, double fwhm) {
+	double sum = 0.0;
+	int j;
+
+	memset(peaks, 0, sizeof (*peaks));
+	if (channels <= 0 || fwhm <= 0.0) {
+		errno = EINVAL;
+		return -1;
+	}
+	peaks->channels = channels;
+	peaks->sigma    = fwhm / 2.3548;
+	peaks->half     = (int) ceil(3.0 * peaks->sigma);
+	if (peaks->half < 2) {
+		peaks->half = 2;
+	}
+	peaks->kernel   = calloc(2 * peaks->half + 1, sizeof (double));
+	peaks->response = calloc(channels, sizeof (double));
+	if (peaks->kernel == NULL || peaks->response == NULL) {
+		PRINT_STD_LIBERROR("calloc");
+		Peaks_Free(peaks);
+		return -1;
+	}
+	// Minus the second derivative of a Gaussian, positive on a peak. The
+	// kernel is made zero sum, so that a constant background cancels
+	for (j = -peaks->half; j <= peaks->half; ++j) {
+		double const u = j / peaks->sigma;
+		peaks->kernel[j + peaks->half] = (1.0 - u * u) * exp(-0.5 * u * u);
+		sum += peaks->kernel[j + peaks->half];
+	}
+	for (j = 0; j <= 2 * peaks->half; ++j) {
+		peaks->kernel[j] -= sum / (2 * peaks->half + 1);
+	}
+	return 0;
+}
+
+static void Peaks_Free(Peaks_Typedef * peaks) {
+	free(peaks->kernel);
+	free(peaks->response);
+	peaks->kernel   = NULL;
+	peaks->response = NULL;
+}
+
+static double Peaks_Model(Peaks_Fit const * fit, double x) {
+	double const d = (x - fit->p[1]) / fit->p[2];
+	return fit->p[0] * exp(-0.5 * d * d) + fit->p[3] +
+			fit->p[4] * (x - 0.5 * (fit->lo + fit->hi));
+}
+
+//! \brief Solves a linear system by Gaussian elimination with partial
+//! pivoting
+//!
+//! \param a is the matrix, destroyed
+//! \param b is the right hand side, replaced by the solution
+//!
+//! \return false if the matrix is singular
+static bool Peaks_Solve(double a [PEAKS_PARAMS][PEAKS_PARAMS],
+		double b [PEAKS_PARAMS]) {
+	int i, j, k, pivot;
+
+	for (k = 0; k < PEAKS_PARAMS; ++k) {
+		pivot = k;
+		for (i = k + 1; i < PEAKS_PARAMS; ++i) {
+			if (fabs(a[i][k]) > fabs(a[pivot][k])) {
+				pivot = i;
+			}
+		}
+		if (fabs(a[pivot][k]) < 1e-300) {
+			return false;
+		}
+		if (pivot != k) {
+			for (j = 0; j < PEAKS_PARAMS; ++j) {
+				double const t = a[k][j];
+				a[k][j] = a[pivot][j];
+				a[pivot][j] = t;
+			}
+			double const t = b[k];
+			b[k] = b[pivot];
+			b[pivot] = t;
+		}
+		for (i = k + 1; i < PEAKS_PARAMS; ++i) {
+			double const f = a[i][k] / a[k][k];
+			for (j = k; j < PEAKS_PARAMS; ++j) {
+				a[i][j] -= f * a[k][j];
+			}
+			b[i] -= f * b[k];
+		}
+	}
+	for (k = PEAKS_PARAMS - 1; k >= 0; --k) {
+		for (j = k + 1; j < PEAKS_PARAMS; ++j) {
+			b[k] -= a[k][j] * b[j];
+		}
+		b[k] /= a[k][k];
+	}
+	return true;
+}
+
+//! \brief Computes the weighted chi square of a fit and, optionally, its
+//! normal equations
+//!
+//! \param fit is the peak, with the parameters to evaluate
+//! \param counts is the spectrum
+//! \param alpha receives the curvature matrix, NULL if not needed
+//! \param beta receives the gradient, NULL if not needed
+//!
+//! \return the chi square
+static double Peaks_Chi2(Peaks_Fit const * fit, uint64_t const * counts,
+		double alpha [PEAKS_PARAMS][PEAKS_PARAMS], double beta [PEAKS_PARAMS]) {
+	double const center = 0.5 * (fit->lo + fit->hi);
+	double chi2 = 0.0;
+	int x, i, j;
+
+	if (alpha != NULL) {
+		memset(alpha, 0, sizeof (double) * PEAKS_PARAMS * PEAKS_PARAMS);
+		memset(beta, 0, sizeof (double) * PEAKS_PARAMS);
+	}
+	for (x = fit->lo; x <= fit->hi; ++x) {
+		double const d = (x - fit->p[1]) / fit->p[2];
+		double const e = exp(-0.5 * d * d);
+		double const g = fit->p[0] * e;
+		double const y = (double) counts[x];
+		// Poisson weights, with empty channels weighted as single counts
+		double const w = 1.0 / (y > 1.0 ? y : 1.0);
+		double const r = y - g - fit->p[3] - fit->p[4] * (x - center);
+
+		chi2 += w * r * r;
+		if (alpha != NULL) {
+			double const df [PEAKS_PARAMS] = {
+				e, g * d / fit->p[2], g * d * d / fit->p[2], 1.0, x - center
+			};
+			for (i = 0; i < PEAKS_PARAMS; ++i) {
+				beta[i] += w * r * df[i];
+				for (j = 0; j <= i; ++j) {
+					alpha[i][j] += w * df[i] * df[j];
+				}
+			}
+		}
+	}
+	if (alpha != NULL) {
+		for (i = 0; i < PEAKS_PARAMS; ++i) {
+			for (j = i + 1; j < PEAKS_PARAMS; ++j) {
+				alpha[i][j] = alpha[j][i];
+			}
+		}
+	}
+	return chi2;
+}
+
+//! \brief Returns true if the parameters describe a peak inside its window
+//!
+//! \param fit is the peak
+static bool Peaks_Sane(Peaks_Fit const * fit) {
+	return fit->p[0] > 0.0 && fit->p[2] > 0.3 &&
+			fit->p[2] < fit->hi - fit->lo &&
+			fit->p[1] > fit->lo && fit->p[1] < fit->hi;
+}
+
+//! \brief Fits a peak by Levenberg-Marquardt, from its current parameters
+//!
+//! \param fit is the peak
+//! \param counts is the spectrum
+static void Peaks_Refine(Peaks_Fit * fit, uint64_t const * counts) {
+	double alpha [PEAKS_PARAMS][PEAKS_PARAMS], beta [PEAKS_PARAMS];
+	double a [PEAKS_PARAMS][PEAKS_PARAMS], delta [PEAKS_PARAMS];
+	double lambda = 1e-3, chi2, trial_chi2;
+	Peaks_Fit trial;
+	int n = fit->hi - fit->lo + 1, it, i, j;
+
+	fit->valid = false;
+	if (n <= PEAKS_PARAMS || !Peaks_Sane(fit)) {
+		return;
+	}
+	chi2 = Peaks_Chi2(fit, counts, alpha, beta);
+	for (it = 0; it < PEAKS_ITERATIONS; ++it) {
+		memcpy(a, alpha, sizeof (a));
+		memcpy(delta, beta, sizeof (delta));
+		for (i = 0; i < PEAKS_PARAMS; ++i) {
+			a[i][i] *= 1.0 + lambda;
+		}
+		if (!Peaks_Solve(a, delta)) {
+			return;
+		}
+		trial = *fit;
+		for (i = 0; i < PEAKS_PARAMS; ++i) {
+			trial.p[i] += delta[i];
+		}
+		trial_chi2 = Peaks_Sane(&trial) ?
+				Peaks_Chi2(&trial, counts, NULL, NULL) : INFINITY;
+		if (trial_chi2 < chi2) {
+			bool const done = chi2 - trial_chi2 < 1e-6 * chi2;
+			*fit = trial;
+			chi2 = Peaks_Chi2(fit, counts, alpha, beta);
+			lambda *= 0.1;
+			if (done) {
+				break;
+			}
+		} else {
+			lambda *= 10.0;
+			if (lambda > 1e10) {
+				break;
+			}
+		}
+	}
+
+	// Errors from the inverse of the curvature matrix, scaled by the reduced
+	// chi square when the model does not describe the data completely
+	double cov [PEAKS_PARAMS][PEAKS_PARAMS];
+	fit->chi2 = chi2 / (n - PEAKS_PARAMS);
+	for (j = 0; j < PEAKS_PARAMS; ++j) {
+		double col [PEAKS_PARAMS] = { 0.0 };
+		col[j] = 1.0;
+		memcpy(a, alpha, sizeof (a));
+		if (!Peaks_Solve(a, col)) {
+			return;
+		}
+		for (i = 0; i < PEAKS_PARAMS; ++i) {
+			cov[i][j] = col[i] * (fit->chi2 > 1.0 ? fit->chi2 : 1.0);
+		}
+	}
+	fit->centroid     = fit->p[1];
+	fit->centroid_err = sqrt(fabs(cov[1][1]));
+	fit->fwhm         = 2.3548 * fit->p[2];
+	fit->area         = sqrt(2.0 * M_PI) * fit->p[0] * fit->p[2];
+	fit->area_err     = sqrt(2.0 * M_PI * fabs(
+			fit->p[2] * fit->p[2] * cov[0][0] + fit->p[0] * fit->p[0] * cov[2][2] +
+			2.0 * fit->p[0] * fit->p[2] * cov[0][2]));
+	fit->valid = true;
+}
+
+//! \brief Sums the counts of the fit window of a peak
+//!
+//! \param fit is the peak
+//! \param counts is the spectrum
+static double Peaks_Counts(Peaks_Fit const * fit, uint64_t const * counts) {
+	double sum = 0.0;
+	int x;
+
+	for (x = fit->lo; x <= fit->hi; ++x) {
+		sum += counts[x];
+	}
+	return sum;
+}
+
+//! \brief Searches the peaks of a spectrum, keeping the fits of the peaks
+//! that were already known
+//!
+//! \param peaks is the state
+//! \param counts is the spectrum
+static void Peaks_Search(Peaks_Typedef * peaks, uint64_t const * counts) {
+	Peaks_Fit found [PEAKS_MAX];
+	double sig [PEAKS_MAX];
+	int const half = peaks->half;
+	int nfound = 0, c, k, j, l, r;
+
+	++peaks->searches;
+	memset(peaks->response, 0, peaks->channels * sizeof (double));
+	for (c = half; c < peaks->channels - half; ++c) {
+		double resp = 0.0, var = 0.0;
+		for (k = -half; k <= half; ++k) {
+			double const w = peaks->kernel[k + half];
+			resp += w * counts[c + k];
+			var  += w * w * counts[c + k];
+		}
+		peaks->response[c] = var > 0.0 ? resp / sqrt(var) : 0.0;
+	}
+
+	for (c = half + 1; c < peaks->channels - half - 1; ++c) {
+		double const s = peaks->response[c];
+		Peaks_Fit * fit;
+		double sigma;
+
+		if (s < PEAKS_THRESHOLD || s < peaks->response[c - 1] ||
+				s <= peaks->response[c + 1]) {
+			continue;
+		}
+		// The positive lobe of the response spans about one sigma of the
+		// peak convolved with the kernel on each side
+		for (l = c; l > 0 && peaks->response[l - 1] > 0.0; --l) {
+		}
+		for (r = c; r < peaks->channels - 1 && peaks->response[r + 1] > 0.0; ++r) {
+		}
+		sigma = 0.5 * (r - l + 1);
+		sigma = sqrt(fmax(sigma * sigma - peaks->sigma * peaks->sigma, 1.0));
+
+		// Keep the most significant peaks, ordered by significance
+		if (nfound == PEAKS_MAX && s <= sig[PEAKS_MAX - 1]) {
+			continue;
+		}
+		j = nfound < PEAKS_MAX ? nfound++ : PEAKS_MAX - 1;
+		for (; j > 0 && sig[j - 1] < s; --j) {
+			found[j] = found[j - 1];
+			sig[j]   = sig[j - 1];
+		}
+		fit = &found[j];
+		sig[j] = s;
+		memset(fit, 0, sizeof (*fit));
+		fit->lo = (int) fmax(c - PEAKS_WINDOW * sigma, 0.0);
+		fit->hi = (int) fmin(c + PEAKS_WINDOW * sigma, peaks->channels - 1.0);
+		if (fit->hi - fit->lo < 2 * PEAKS_PARAMS) {
+			fit->lo = c - PEAKS_PARAMS > 0 ? c - PEAKS_PARAMS : 0;
+			fit->hi = c + PEAKS_PARAMS < peaks->channels ?
+					c + PEAKS_PARAMS : peaks->channels - 1;
+		}
+		// Starting point: a line through the edges and the peak above it
+		fit->p[3] = 0.5 * ((double) counts[fit->lo] + counts[fit->hi]);
+		fit->p[4] = ((double) counts[fit->hi] - counts[fit->lo]) /
+				(fit->hi - fit->lo);
+		fit->p[1] = c;
+		fit->p[2] = sigma;
+		fit->p[0] = counts[c] - fit->p[3] - fit->p[4] *
+				(c - 0.5 * (fit->lo + fit->hi));
+		if (fit->p[0] <= 0.0) {
+			fit->p[0] = 1.0;
+		}
+
+		// A peak already known keeps its last fit, and is fitted again only
+		// when its counts change
+		for (k = 0; k < peaks->npeaks; ++k) {
+			Peaks_Fit const * old = &peaks->peaks[k];
+			if (old->valid && fabs(old->centroid - c) < fmax(old->p[2], 1.0)) {
+				*fit = *old;
+				break;
+			}
+		}
+	}
+
+	// Store the peaks by channel, the order of the labels on the plot
+	for (j = 1; j < nfound; ++j) {
+		Peaks_Fit const t = found[j];
+		for (k = j; k > 0 && found[k - 1].p[1] > t.p[1]; --k) {
+			found[k] = found[k - 1];
+		}
+		found[k] = t;
+	}
+	memcpy(peaks->peaks, found, nfound * sizeof (Peaks_Fit));
+	peaks->npeaks = nfound;
+}
+
+static int Peaks_Update(Peaks_Typedef * peaks, uint64_t const * counts) {
+	double total = 0.0;
+	int fits = 0, j;
+
+	for (j = 0; j < peaks->channels; ++j) {
+		total += counts[j];
+	}
+	// A spectrum that shrank was reset, search it again from scratch
+	if (total < peaks->searched) {
+		peaks->npeaks = 0;
+	}
+	if (total < peaks->searched ||
+			total > peaks->searched * (1.0 + PEAKS_REFIT)) {
+		Peaks_Search(peaks, counts);
+		peaks->searched = total;
+	}
+	for (j = 0; j < peaks->npeaks; ++j) {
+		Peaks_Fit * fit = &peaks->peaks[j];
+		double const n = Peaks_Counts(fit, counts);
+		// A fit that failed is only tried again with more counts as well
+		if (fit->counts > 0.0 && fabs(n - fit->counts) <= PEAKS_REFIT * fit->counts) {
+			continue;
+		}
+		Peaks_Refine(fit, counts);
+		fit->counts = n;
+		++fits;
+	}
+	peaks->fits += fits;
+	return fits;
+}
+
+static void Peaks_Print(Peaks_Typedef const * peaks, FILE * out) {
+	int j;
+
+	for (j = 0; j < peaks->npeaks; ++j) {
+		Peaks_Fit const * fit = &peaks->peaks[j];
+		if (!fit->valid) {
+			continue;
+		}
+		fprintf(out, "peak %d: centroid %.2f +- %.2f, FWHM %.2f, "
+				"area %.0f +- %.0f, chi2/ndf %.2f\n", j, fit->centroid,
+				fit->centroid_err, fit->fwhm, fit->area, fit->area_err, fit->chi2);
+	}
+}
+
+#endif // PEAKS_H
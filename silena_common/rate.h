@@ -0,0 +1,247 @@
+/****************************************************************************
+ * Copyright (C) 2021 by Rodrigo Torres                                     *
+ *                                                                          *
+ *   This program free software: you can redistribute it and/or modify it   *
+ *   under the terms of the GNU Lesser General Public License as published  *
+ *   by the Free Software Foundation, either version 3 of the License, or   *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   This program is distributed in the hope that it will be useful,        *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU Lesser General Public License for more details.                    *
+ *                                                                          *
+ *   You should have received a copy of the GNU Lesser General Public       *
+ *   License along with this program.                                       *
+ ***************************************************************************/
+
+//! \file rate.h
+//! \brief Event rate and inter-arrival time analysis from the timestamps of
+//! the events
+//!
+//! The rates are computed on the time of the events, not on the time they
+//! are read, so batching in the driver does not distort them. The rate over
+//! W seconds counts the last W complete seconds.
+//!
+//! Inter-arrival times are histogrammed in microseconds with
+//! RATE_BINS_PER_OCTAVE linear bins per power of two. For a Poisson source
+//! behind a non-paralyzable dead time tau the intervals are exponential
+//! above tau and absent below it, so the shortest intervals of the run give
+//! tau.
+
+#ifndef RATE_H
+#define RATE_H
+
+#include "silenar.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+//! \def RATE_SECONDS
+//! \brief Number of one second buckets, more than the longest window
+#define RATE_SECONDS 64
+//! \def RATE_WINDOWS
+//! \brief Number of rate windows, see rate_windows
+#define RATE_WINDOWS 3
+//! \def RATE_BINS_PER_OCTAVE
+//! \brief Bins of the inter-arrival histogram per power of two
+#define RATE_BINS_PER_OCTAVE 4
+//! \def RATE_OCTAVES
+//! \brief Powers of two covered by the inter-arrival histogram, up to 2^28
+//! microseconds. Longer intervals go to the last bin
+#define RATE_OCTAVES 28
+//! \def RATE_BINS
+//! \brief Bins of the inter-arrival histogram, bin 0 holds the intervals
+//! shorter than a microsecond
+#define RATE_BINS (1 + RATE_OCTAVES * RATE_BINS_PER_OCTAVE)
+//! \def RATE_SHORTEST
+//! \brief The dead time is the longest of this many shortest intervals, so a
+//! few glitches do not spoil the estimate
+#define RATE_SHORTEST 16
+
+//! \brief Lengths of the rate windows, in seconds
+static int const rate_windows [RATE_WINDOWS] = { 1, 10, 60 };
+
+typedef struct {
+	uint64_t events;		///< Events analyzed
+	int64_t last_us;		///< Timestamp of the last event
+	int64_t first_second;	///< Second of the first event
+	int64_t second;			///< Second of the current bucket
+	uint64_t seconds [RATE_SECONDS];	///< Events per second, a ring
+	uint64_t intervals [RATE_BINS];		///< Inter-arrival time histogram
+	int64_t shortest [RATE_SHORTEST];	///< Shortest intervals, ascending
+	int nshortest;			///< Entries of shortest
+} Rate_Typedef;
+
+//! \brief The results of the analysis, small enough to be copied per frame
+typedef struct {
+	double rate [RATE_WINDOWS];	///< Events per second, see rate_windows
+	double dead_us;			///< Estimated dead time per event, 0 if unknown
+	double dead_fraction;	///< Fraction of the time the ADC was dead
+	double true_rate;		///< Rate over 10 s corrected for the dead time
+} Rate_Summary;
+
+//! \brief Resets the analysis
+//!
+//! \param rate is the analysis
+static void Rate_Init(Rate_Typedef * rate);
+
+//! \brief Analyzes a batch of events, in the order they were read
+//!
+//! \param rate is the analysis
+//! \param events are the events
+//! \param count is the number of events
+static void Rate_Fill(Rate_Typedef * rate, struct event const * events,
+		int count);
+
+//! \brief Computes the rates and the dead time
+//!
+//! \param rate is the analysis
+//! \param now is the current second, CLOCK_REALTIME like the events. The
+//! seconds without events after the last one count as empty
+//! \param summary receives the results
+static void Rate_Summarize(Rate_Typedef const * rate, int64_t now,
+		Rate_Summary * summary);
+
+//! \brief Prints the inter-arrival time histogram, one line per bin with the
+//! lower edge in microseconds and the counts
+//!
+//! \param rate is the analysis
+//! \param out is the stream
+static void Rate_Print(Rate_Typedef const * rate, FILE * out);
+
+static void Rate_Init(Rate_Typedef * rate) {
+	memset(rate, 0, sizeof (*rate));
+}
+
+//! \brief Returns the bin of an interval
+//!
+//! \param dt is the interval in microseconds, not negative
+static inline int Rate_Bin(uint64_t dt) {
+	int octave, sub, bin;
+
+	if (dt == 0) {
+		return 0;
+	}
+	octave = 63 - __builtin_clzll(dt);
+	// The bits below the leading one select the linear bin in the octave
+	sub = octave >= 2 ? (dt >> (octave - 2)) & 3 : (dt << (2 - octave)) & 3;
+	bin = 1 + octave * RATE_BINS_PER_OCTAVE + sub;
+	return bin < RATE_BINS ? bin : RATE_BINS - 1;
+}
+
+//! \brief Returns the lower edge of a bin in microseconds
+//!
+//! \param bin is the bin
+static inline double Rate_BinLow(int bin) {
+	if (bin == 0) {
+		return 0.0;
+	}
+	--bin;
+	return (double) (1ULL << (bin / RATE_BINS_PER_OCTAVE)) *
+			(1.0 + (double) (bin % RATE_BINS_PER_OCTAVE) / RATE_BINS_PER_OCTAVE);
+}
+
+//! \brief Keeps an interval if it is among the shortest of the run
+//!
+//! \param rate is the analysis
+//! \param dt is the interval in microseconds
+static inline void Rate_Shortest(Rate_Typedef * rate, int64_t dt) {
+	int j;
+
+	if (rate->nshortest == RATE_SHORTEST) {
+		if (dt >= rate->shortest[RATE_SHORTEST - 1]) {
+			return;
+		}
+		--rate->nshortest;
+	}
+	for (j = rate->nshortest; j > 0 && rate->shortest[j - 1] > dt; --j) {
+		rate->shortest[j] = rate->shortest[j - 1];
+	}
+	rate->shortest[j] = dt;
+	++rate->nshortest;
+}
+
+static void Rate_Fill(Rate_Typedef * rate, struct event const * events,
+		int count) {
+	int j;
+
+	for (j = 0; j < count; ++j) {
+		int64_t const sec = events[j].tv_sec;
+		int64_t const us = sec * 1000000LL + events[j].tv_usec;
+
+		if (rate->events == 0) {
+			rate->first_second = rate->second = sec;
+		} else {
+			int64_t const dt = us - rate->last_us;
+			// A step of the realtime clock backwards is not an interval
+			if (dt >= 0) {
+				++rate->intervals[Rate_Bin(dt)];
+				Rate_Shortest(rate, dt);
+			}
+		}
+		// Start the buckets of the seconds elapsed since the previous event
+		if (sec > rate->second) {
+			int64_t s = sec - rate->second > RATE_SECONDS ?
+					sec - RATE_SECONDS : rate->second;
+			while (s < sec) {
+				rate->seconds[++s % RATE_SECONDS] = 0;
+			}
+			rate->second = sec;
+		}
+		++rate->seconds[rate->second % RATE_SECONDS];
+		rate->last_us = us;
+		++rate->events;
+	}
+}
+
+static void Rate_Summarize(Rate_Typedef const * rate, int64_t now,
+		Rate_Summary * summary) {
+	int w, s;
+
+	memset(summary, 0, sizeof (*summary));
+	if (rate->events == 0) {
+		return;
+	}
+	if (now < rate->second) {
+		now = rate->second;
+	}
+	for (w = 0; w < RATE_WINDOWS; ++w) {
+		// Only complete seconds, and no more than the run lasted
+		int64_t span = rate_windows[w];
+		uint64_t sum = 0;
+
+		if (span > now - rate->first_second) {
+			span = now - rate->first_second;
+		}
+		for (s = 1; s <= span; ++s) {
+			int64_t const sec = now - s;
+			if (sec <= rate->second && rate->second - sec < RATE_SECONDS) {
+				sum += rate->seconds[sec % RATE_SECONDS];
+			}
+		}
+		summary->rate[w] = span > 0 ? (double) sum / span : 0.0;
+	}
+
+	if (rate->nshortest == RATE_SHORTEST) {
+		summary->dead_us = rate->shortest[RATE_SHORTEST - 1];
+	}
+	summary->dead_fraction = summary->rate[1] * summary->dead_us * 1e-6;
+	summary->true_rate = summary->dead_fraction < 1.0 ?
+			summary->rate[1] / (1.0 - summary->dead_fraction) : 0.0;
+}
+
+static void Rate_Print(Rate_Typedef const * rate, FILE * out) {
+	int j;
+
+	for (j = 0; j < RATE_BINS; ++j) {
+		if (rate->intervals[j]) {
+			fprintf(out, "%.0f %llu\n", Rate_BinLow(j),
+					(unsigned long long) rate->intervals[j]);
+		}
+	}
+}
+
+#endif // RATE_H
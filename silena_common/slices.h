@@ -0,0 +1,352 @@
+/****************************************************************************
+ * Copyright (C) 2021 by Rodrigo Torres                                     *
+ *                                                                          *
+ *   This program free software: you can redistribute it and/or modify it   *
+ *   under the terms of the GNU Lesser General Public License as published  *
+ *   by the Free Software Foundation, either version 3 of the License, or   *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   This program is distributed in the hope that it will be useful,        *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU Lesser General Public License for more details.                    *
+ *                                                                          *
+ *   You should have received a copy of the GNU Lesser General Public       *
+ *   License along with this program.                                       *
+ ***************************************************************************/
+
+//! \file slices.h
+//! \brief A ring of spectra, one per time interval, to follow the drift of
+//! the gain over a long run
+//!
+//! The spectra are the rows of one time x channel matrix of 32-bit counts,
+//! the oldest row is reused when the ring is full. Channels can be merged by
+//! a power of two to make the rows smaller. When a slice ends, the centroid
+//! of each peak region is computed on its spectrum, over a linear background
+//! drawn between the edges of the region.
+//!
+//! Slices follow the timestamps of the events, a slice that saw no events is
+//! kept as an empty row.
+
+#ifndef SLICES_H
+#define SLICES_H
+
+#include "silenar.h"
+#include "utility.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//! \def SLICES_PEAKS
+//! \brief Largest number of tracked peaks
+#define SLICES_PEAKS 8
+//! \def SLICES_EDGE
+//! \brief Channels averaged at each edge of a region for the background
+#define SLICES_EDGE 3
+
+//! \brief A peak region, in channels before merging
+typedef struct {
+	uint32_t lo;			///< First channel of the region
+	uint32_t hi;			///< Last channel of the region
+} Slices_Peak;
+
+//! \brief The summary of one slice
+typedef struct {
+	int64_t start;			///< Start of the slice, seconds, CLOCK_REALTIME
+	uint64_t events;		///< Events in the slice
+	double centroid [SLICES_PEAKS];	///< Centroid of each peak, channels
+	double error [SLICES_PEAKS];	///< Statistical error of the centroid
+	double area [SLICES_PEAKS];		///< Net counts of each peak
+} Slices_Info;
+
+typedef struct {
+	int channels;			///< Channels of the ADC
+	int shift;				///< Channels merged in a row, log2
+	int bins;				///< Columns of the matrix, channels >> shift
+	int length;				///< Length of a slice, seconds
+	int nslices;			///< Rows of the ring
+	int npeaks;				///< Tracked peaks
+	Slices_Peak peaks [SLICES_PEAKS];	///< The regions of the tracked peaks
+	uint32_t * counts;		///< The matrix, nslices x bins
+	Slices_Info * info;		///< The summary of each row
+	int64_t current;		///< Index of the current slice since the epoch, -1
+	uint64_t closed;		///< Slices closed since the start
+	Slices_Info last;		///< Summary of the last slice closed with events
+} Slices_Typedef;
+
+//! \brief Allocates an empty ring
+//!
+//! \param slices is the ring to initialize
+//! \param channels is the number of ADC channels
+//! \param shift merges 2^shift channels in each column
+//! \param length is the length of a slice in seconds
+//! \param nslices is the number of slices kept
+//!
+//! \return 0 on success, -1 otherwise
+static int Slices_Init(Slices_Typedef * slices, int channels, int shift,
+		int length, int nslices);
+
+//! \brief Releases the memory of the ring
+//!
+//! \param slices is the ring, initialized or zeroed
+static void Slices_Free(Slices_Typedef * slices);
+
+//! \brief Adds a peak region to track
+//!
+//! \param slices is the ring
+//! \param lo is the first channel of the region
+//! \param hi is the last channel of the region
+//!
+//! \return 0 on success, -1 if the region is invalid or there are too many
+static int Slices_AddPeak(Slices_Typedef * slices, uint32_t lo, uint32_t hi);
+
+//! \brief Adds a batch of events, in the order they were read
+//!
+//! \param slices is the ring
+//! \param events are the events
+//! \param count is the number of events
+//!
+//! \return the number of slices closed by the batch, see Slices_Last()
+static int Slices_Fill(Slices_Typedef * slices, struct event const * events,
+		int count);
+
+//! \brief Returns the summary of the last closed slice with events, NULL if
+//! none. The empty slices of a gap in the events are skipped
+//!
+//! \param slices is the ring
+static Slices_Info const * Slices_Last(Slices_Typedef const * slices);
+
+//! \brief Writes the matrix and the centroids, the oldest slice first. The
+//! current slice is included, with its centroids computed so far
+//!
+//! \param slices is the ring
+//! \param prefix names the files: prefix.matrix holds one row of counts per
+//! slice, as "plot 'prefix.matrix' matrix with image" expects, and
+//! prefix.centroids one line per slice with the time, the events and the
+//! centroid, error and area of each peak
+//!
+//! \return 0 on success, -1 otherwise
+static int Slices_Dump(Slices_Typedef * slices, char const * prefix);
+
+static int Slices_Init(Slices_Typedef * slices, int channels, int shift,
+		int length, int nslices) {
+	memset(slices, 0, sizeof (*slices));
+	if (channels <= 0 || shift < 0 || shift > 12 || length <= 0 ||
+			nslices <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	slices->channels = channels;
+	slices->shift    = shift;
+	slices->bins     = (channels + (1 << shift) - 1) >> shift;
+	slices->length   = length;
+	slices->nslices  = nslices;
+	slices->current  = -1;
+	slices->counts = calloc((size_t) nslices * slices->bins, sizeof (uint32_t));
+	slices->info   = calloc(nslices, sizeof (Slices_Info));
+	if (slices->counts == NULL || slices->info == NULL) {
+		PRINT_STD_LIBERROR("calloc");
+		Slices_Free(slices);
+		return -1;
+	}
+	return 0;
+}
+
+static void Slices_Free(Slices_Typedef * slices) {
+	free(slices->counts);
+	free(slices->info);
+	slices->counts = NULL;
+	slices->info   = NULL;
+}
+
+static int Slices_AddPeak(Slices_Typedef * slices, uint32_t lo, uint32_t hi) {
+	if (slices->npeaks == SLICES_PEAKS || lo >= hi ||
+			hi >= (uint32_t) slices->channels) {
+		errno = EINVAL;
+		return -1;
+	}
+	slices->peaks[slices->npeaks].lo = lo;
+	slices->peaks[slices->npeaks].hi = hi;
+	++slices->npeaks;
+	return 0;
+}
+
+//! \brief Returns the row of a slice
+//!
+//! \param slices is the ring
+//! \param index is the index of the slice since the epoch
+static inline uint32_t * Slices_Row(Slices_Typedef const * slices,
+		int64_t index) {
+	return slices->counts + (size_t) (index % slices->nslices) * slices->bins;
+}
+
+//! \brief Computes the centroids of the peaks on a row
+//!
+//! \param slices is the ring
+//! \param index is the index of the slice since the epoch
+static void Slices_Centroids(Slices_Typedef * slices, int64_t index) {
+	uint32_t const * row = Slices_Row(slices, index);
+	Slices_Info * info = &slices->info[index % slices->nslices];
+	int p, lo, hi, j, n;
+
+	for (p = 0; p < slices->npeaks; ++p) {
+		double left = 0.0, right = 0.0, sum = 0.0, moment = 0.0, square = 0.0;
+
+		lo = slices->peaks[p].lo >> slices->shift;
+		hi = slices->peaks[p].hi >> slices->shift;
+		// Background level at each edge, inside the region
+		n = hi - lo + 1 < 2 * SLICES_EDGE ? 1 : SLICES_EDGE;
+		for (j = 0; j < n; ++j) {
+			left  += row[lo + j];
+			right += row[hi - j];
+		}
+		left  /= n;
+		right /= n;
+
+		for (j = lo; j <= hi; ++j) {
+			// Bins are weighted at their center, in channels before merging
+			double const x = ((double) j + 0.5) * (1 << slices->shift);
+			double const bg = hi > lo ?
+					left + (right - left) * (j - lo) / (hi - lo) : left;
+			double const net = row[j] - bg;
+			if (net > 0.0) {
+				sum    += net;
+				moment += net * x;
+				square += net * x * x;
+			}
+		}
+		info->area[p] = sum;
+		if (sum > 0.0) {
+			double const mean = moment / sum;
+			double const var = square / sum - mean * mean;
+			info->centroid[p] = mean;
+			info->error[p] = var > 0.0 ? sqrt(var / sum) : 0.0;
+		} else {
+			info->centroid[p] = info->error[p] = NAN;
+		}
+	}
+}
+
+//! \brief Moves to the slice of an event, closing the current one and
+//! clearing the rows of the slices in between
+//!
+//! \param slices is the ring
+//! \param index is the index of the new slice since the epoch
+static void Slices_Advance(Slices_Typedef * slices, int64_t index) {
+	int64_t next, first;
+	int p;
+
+	if (slices->current != -1) {
+		Slices_Centroids(slices, slices->current);
+		// Copied, the row may be reused below when the gap is long
+		slices->last = slices->info[slices->current % slices->nslices];
+		++slices->closed;
+		next = slices->current + 1;
+	} else {
+		next = index;
+	}
+	// Only the last nslices rows can still be in the ring
+	first = index - next >= slices->nslices ? index - slices->nslices + 1 : next;
+	for (; first <= index; ++first) {
+		Slices_Info * info = &slices->info[first % slices->nslices];
+		memset(Slices_Row(slices, first), 0, slices->bins * sizeof (uint32_t));
+		memset(info, 0, sizeof (*info));
+		info->start = first * slices->length;
+		for (p = 0; p < slices->npeaks; ++p) {
+			info->centroid[p] = info->error[p] = NAN;
+		}
+	}
+	slices->closed += index - next;
+	slices->current = index;
+}
+
+static int Slices_Fill(Slices_Typedef * slices, struct event const * events,
+		int count) {
+	uint64_t const closed = slices->closed;
+	uint32_t * row = slices->current != -1 ?
+			Slices_Row(slices, slices->current) : NULL;
+	int j;
+
+	for (j = 0; j < count; ++j) {
+		int64_t const index = events[j].tv_sec / slices->length;
+
+		// The realtime clock may step back, keep such events in the slice
+		if (index > slices->current) {
+			Slices_Advance(slices, index);
+			row = Slices_Row(slices, index);
+		}
+		if (events[j].value < (uint32_t) slices->channels) {
+			++row[events[j].value >> slices->shift];
+		}
+		++slices->info[slices->current % slices->nslices].events;
+	}
+	return slices->closed - closed;
+}
+
+static Slices_Info const * Slices_Last(Slices_Typedef const * slices) {
+	if (slices->closed == 0) {
+		return NULL;
+	}
+	return &slices->last;
+}
+
+static int Slices_Dump(Slices_Typedef * slices, char const * prefix) {
+	char path [4096];
+	FILE * matrix, * centroids;
+	int64_t first, index;
+	int j, p;
+
+	if (slices->current == -1) {
+		return 0;
+	}
+	snprintf(path, sizeof (path), "%s.matrix", prefix);
+	matrix = fopen(path, "w");
+	snprintf(path, sizeof (path), "%s.centroids", prefix);
+	centroids = fopen(path, "w");
+	if (matrix == NULL || centroids == NULL) {
+		PRINT_STD_LIBERROR("fopen");
+		if (matrix != NULL) {
+			fclose(matrix);
+		}
+		if (centroids != NULL) {
+			fclose(centroids);
+		}
+		return -1;
+	}
+
+	Slices_Centroids(slices, slices->current);
+	first = slices->current - slices->nslices + 1;
+	if (first < slices->current - (int64_t) slices->closed) {
+		first = slices->current - slices->closed;
+	}
+	fprintf(centroids, "# start events");
+	for (p = 0; p < slices->npeaks; ++p) {
+		fprintf(centroids, " centroid%d error%d area%d", p, p, p);
+	}
+	fprintf(centroids, "\n");
+	for (index = first; index <= slices->current; ++index) {
+		uint32_t const * row = Slices_Row(slices, index);
+		Slices_Info const * info = &slices->info[index % slices->nslices];
+
+		for (j = 0; j < slices->bins; ++j) {
+			fprintf(matrix, j ? " %u" : "%u", row[j]);
+		}
+		fprintf(matrix, "\n");
+		fprintf(centroids, "%lld %llu", (long long) info->start,
+				(unsigned long long) info->events);
+		for (p = 0; p < slices->npeaks; ++p) {
+			fprintf(centroids, " %.3f %.3f %.0f", info->centroid[p],
+					info->error[p], info->area[p]);
+		}
+		fprintf(centroids, "\n");
+	}
+	fclose(matrix);
+	fclose(centroids);
+	return 0;
+}
+
+#endif // SLICES_H
@@ -0,0 +1,351 @@
+/****************************************************************************
+ * Copyright (C) 2021 by Rodrigo Torres                                     *
+ *                                                                          *
+ *   main.c                                                                 *
+ *                                                                          *
+ *   This program free software: you can redistribute it and/or modify it   *
+ *   under the terms of the GNU Lesser General Public License as published  *
+ *   by the Free Software Foundation, either version 3 of the License, or   *
+ *   (at your option) any later version.                                    *
+ *                                                                          *
+ *   This program is distributed in the hope that it will be useful,        *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of         *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the          *
+ *   GNU Lesser General Public License for more details.                    *
+ *                                                                          *
+ *   You should have received a copy of the GNU Lesser General Public       *
+ *   License along with this program.                                       *
+ ***************************************************************************/
+
+/*! \file main.c
+    \brief Histograms list-mode files recorded by kdaq_client -o
+
+    The files are mapped in memory and their blocks are split in contiguous
+    ranges, one per thread. Each thread applies the cuts and the calibration
+    to its blocks and fills its own shard of the histogram, the shards are
+    merged at the end. The index record of each block is checked against the
+    time window first, so the blocks outside of it are never read.
+ */
+
+#include "histo.h"
+#include "listmode.h"
+#include "utility.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define HIST_SIZE 8192
+#define MAX_THREADS 64
+
+//! \brief A block of a mapped file, the unit of work of the threads
+typedef struct {
+	struct listmode_block const * header;	///< The block in the mapping
+	int64_t start_us;	///< Start of the run of the block, CLOCK_REALTIME
+} Block_Typedef;
+
+//! \brief The range of blocks of a thread and its results
+typedef struct {
+	pthread_t thread;
+	int shard;			///< Shard of the histogram filled by the thread
+	size_t first;		///< First block of the range
+	size_t last;		///< One past the last block of the range
+	uint64_t events;	///< Events read
+	uint64_t accepted;	///< Events that passed the cuts
+	uint64_t bytes;		///< Bytes of the blocks read
+} Worker_Typedef;
+
+//! \brief The cuts and the calibration applied to each event
+typedef struct {
+	uint32_t lld;		///< Lowest ADC value accepted
+	uint32_t uld;		///< Highest ADC value accepted
+	int64_t from_us;	///< Start of the time window, since the run start
+	int64_t to_us;		///< End of the time window, since the run start
+	double offset;		///< Channel of ADC value 0
+	double gain;		///< Channels per ADC value
+	bool calibrate;		///< False if the channel is the ADC value
+} Cuts_Typedef;
+
+Histo_Typedef histo;		///< The spectrum, one shard per thread
+Cuts_Typedef cuts = {
+	.lld = 0, .uld = UINT32_MAX, .from_us = INT64_MIN / 2, .to_us = INT64_MAX / 2,
+	.offset = 0.0, .gain = 1.0, .calibrate = false
+};
+Block_Typedef * blocks = NULL;	///< The blocks of every file, in order
+size_t nblocks = 0;
+uint64_t lost = 0;			///< Events the recorder dropped
+
+//! @brief Prints the command line options
+//!
+//! @param name is the name of the program
+void PrintUsage (char const * name);
+
+//! @brief Maps a list-mode file and appends its blocks to the work list
+//!
+//! @param path is the path of the file
+//!
+//! @return the number of bytes mapped, 0 in case of error
+size_t MapFile (char const * path);
+
+//! @brief Body of the threads, histograms a range of blocks
+//!
+//! @param arg is a pointer to the Worker_Typedef of the thread
+void * Replay (void * arg);
+
+int main(int argc, char * argv[]) {
+	Worker_Typedef workers [MAX_THREADS];
+	struct timespec start, stop;
+	uint64_t counts [HIST_SIZE], events = 0, accepted = 0, bytes = 0, overflow;
+	char const * out_path = NULL;
+	double elapsed, from_s, to_s;
+	FILE * out = stdout;
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt, j;
+
+	while ((opt = getopt(argc, argv, "j:c:w:k:o:h")) != -1) {
+		switch (opt) {
+			case 'j':
+				threads = atoi(optarg);
+				break;
+			case 'c':
+				if (sscanf(optarg, "%" SCNu32 ":%" SCNu32, &cuts.lld, &cuts.uld) != 2) {
+					PrintUsage(argv[0]);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'w':
+				if (sscanf(optarg, "%lf:%lf", &from_s, &to_s) != 2) {
+					PrintUsage(argv[0]);
+					return EXIT_FAILURE;
+				}
+				cuts.from_us = from_s * 1e6;
+				cuts.to_us   = to_s * 1e6;
+				break;
+			case 'k':
+				if (sscanf(optarg, "%lf:%lf", &cuts.offset, &cuts.gain) != 2) {
+					PrintUsage(argv[0]);
+					return EXIT_FAILURE;
+				}
+				cuts.calibrate = true;
+				break;
+			case 'o':
+				out_path = optarg;
+				break;
+			default:
+				PrintUsage(argv[0]);
+				return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (optind == argc) {
+		PrintUsage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (threads < 1) {
+		threads = 1;
+	}
+	if (threads > MAX_THREADS) {
+		threads = MAX_THREADS;
+	}
+
+	for (j = optind; j < argc; ++j) {
+		if (MapFile(argv[j]) == 0) {
+			return EXIT_FAILURE;
+		}
+	}
+	if ((size_t) threads > nblocks) {
+		threads = nblocks ? nblocks : 1;
+	}
+	if (Histo_Init(&histo, HIST_SIZE, threads) == -1) {
+		return EXIT_FAILURE;
+	}
+
+	// Contiguous ranges of blocks, so each thread streams through its part
+	// of the files
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (j = 0; j < threads; ++j) {
+		memset(&workers[j], 0, sizeof (workers[j]));
+		workers[j].shard = j;
+		workers[j].first = nblocks * j / threads;
+		workers[j].last  = nblocks * (j + 1) / threads;
+		errno = pthread_create(&workers[j].thread, NULL, &Replay, &workers[j]);
+		if (errno) {
+			PRINT_STD_LIBERROR("pthread_create");
+			return EXIT_FAILURE;
+		}
+	}
+	for (j = 0; j < threads; ++j) {
+		pthread_join(workers[j].thread, NULL);
+		events   += workers[j].events;
+		accepted += workers[j].accepted;
+		bytes    += workers[j].bytes;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	overflow = Histo_Snapshot(&histo, counts, false);
+
+	if (out_path != NULL) {
+		out = fopen(out_path, "w");
+		if (out == NULL) {
+			PRINT_STD_LIBERROR("fopen");
+			return EXIT_FAILURE;
+		}
+	}
+	for (j = 0; j < HIST_SIZE; ++j) {
+		fprintf(out, "%d %" PRIu64 "\n", j, counts[j]);
+	}
+	if (out != stdout) {
+		fclose(out);
+	}
+
+	elapsed = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) * 1e-9;
+	fprintf(stderr, "%zu blocks, %" PRIu64 " events, %" PRIu64 " accepted, "
+			"%" PRIu64 " out of range, %" PRIu64 " lost by the recorder\n",
+			nblocks, events, accepted, overflow, lost);
+	fprintf(stderr, "%d threads, %.3f s, %.2f GB/s, %.1f Mevents/s\n", threads,
+			elapsed, elapsed > 0 ? bytes / elapsed * 1e-9 : 0.0,
+			elapsed > 0 ? events / elapsed * 1e-6 : 0.0);
+
+	Histo_Free(&histo);
+	free(blocks);
+	return EXIT_SUCCESS;
+}
+
+void PrintUsage (char const * name) {
+	fprintf(stderr, "usage: %s [options] file" LISTMODE_SUFFIX "...\n"
+			"  -j threads   number of threads, one per CPU by default\n"
+			"  -c lld:uld   keep the ADC values between lld and uld\n"
+			"  -w from:to   keep the events between from and to seconds after\n"
+			"               the start of the run\n"
+			"  -k off:gain  channel = off + gain * ADC value\n"
+			"  -o file      write the histogram to file instead of stdout\n",
+			name);
+}
+
+size_t MapFile (char const * path) {
+	struct listmode_run const * run;
+	Block_Typedef * grown;
+	struct stat st;
+	char const * map;
+	size_t nfile, j;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		PRINT_STD_LIBERROR(path);
+		return 0;
+	}
+	if (fstat(fd, &st) == -1) {
+		PRINT_STD_LIBERROR(path);
+		close(fd);
+		return 0;
+	}
+	if ((size_t) st.st_size < LISTMODE_RUN_SIZE) {
+		PRINT_ERRMSG("file too short for a list-mode run header");
+		close(fd);
+		return 0;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		PRINT_STD_LIBERROR("mmap");
+		return 0;
+	}
+	// Every block is read once from start to end
+	madvise((void *) map, st.st_size, MADV_SEQUENTIAL);
+
+	run = (struct listmode_run const *) map;
+	if (run->magic != LISTMODE_RUN_MAGIC || run->version != LISTMODE_VERSION ||
+			run->block_size != LISTMODE_BLOCK_SIZE ||
+			run->event_size != sizeof (struct event)) {
+		fprintf(stderr, "%s: not a list-mode file of version %d\n", path,
+				LISTMODE_VERSION);
+		munmap((void *) map, st.st_size);
+		return 0;
+	}
+	// The blocks start after the run header, which must fit the file
+	if (run->run_size < LISTMODE_RUN_SIZE ||
+			run->run_size > (uint64_t) st.st_size) {
+		fprintf(stderr, "%s: run header of %u bytes is corrupted\n", path,
+				(unsigned) run->run_size);
+		munmap((void *) map, st.st_size);
+		return 0;
+	}
+
+	nfile = (st.st_size - run->run_size) / run->block_size;
+	grown = realloc(blocks, (nblocks + nfile) * sizeof (*blocks));
+	if (grown == NULL && nblocks + nfile > 0) {
+		PRINT_STD_LIBERROR("realloc");
+		munmap((void *) map, st.st_size);
+		return 0;
+	}
+	blocks = grown;
+	for (j = 0; j < nfile; ++j) {
+		struct listmode_block const * header = (struct listmode_block const *)
+				(map + run->run_size + j * run->block_size);
+		if (header->magic != LISTMODE_BLOCK_MAGIC ||
+				header->events > LISTMODE_BLOCK_EVENTS) {
+			fprintf(stderr, "%s: block %zu is corrupted, skipped\n", path, j);
+			continue;
+		}
+		blocks[nblocks].header   = header;
+		blocks[nblocks].start_us = run->start_ns / 1000;
+		lost += header->lost;
+		++nblocks;
+	}
+	return st.st_size;
+}
+
+void * Replay (void * arg) {
+	Worker_Typedef * worker = arg;
+	uint32_t values [LISTMODE_BLOCK_EVENTS];
+	bool const timed = cuts.from_us != INT64_MIN / 2 || cuts.to_us != INT64_MAX / 2;
+	size_t b;
+
+	for (b = worker->first; b < worker->last; ++b) {
+		struct listmode_block const * header = blocks[b].header;
+		struct event const * event = (struct event const *) (header + 1);
+		int64_t const from_us = blocks[b].start_us + cuts.from_us;
+		int64_t const to_us = blocks[b].start_us + cuts.to_us;
+		uint32_t n = 0, j;
+
+		// The index record tells whether the block overlaps the window
+		if (header->last_us < from_us || header->first_us > to_us) {
+			continue;
+		}
+		worker->events += header->events;
+		worker->bytes  += sizeof (*header) + header->events * sizeof (*event);
+
+		for (j = 0; j < header->events; ++j) {
+			uint32_t const value = event[j].value;
+			if (value < cuts.lld || value > cuts.uld) {
+				continue;
+			}
+			if (timed) {
+				int64_t const us = event[j].tv_sec * 1000000LL + event[j].tv_usec;
+				if (us < from_us || us > to_us) {
+					continue;
+				}
+			}
+			if (cuts.calibrate) {
+				double const ch = cuts.offset + cuts.gain * value;
+				// Negative channels go to the overflow counter as well
+				values[n++] = ch >= 0.0 && ch < HIST_SIZE ? (uint32_t) ch : HIST_SIZE;
+			} else {
+				values[n++] = value;
+			}
+		}
+		worker->accepted += n;
+		Histo_Fill(&histo, worker->shard, values, sizeof (uint32_t), n);
+	}
+	return NULL;
+}
@@ -23,8 +23,12 @@
     Details.
  */
 
+#include "silenar.h"
 #include "utility.h"
 #include "gnuplot.h"
+#include "display.h"
+#include "histo.h"
+#include "rate.h"
 
 #include <fcntl.h>
 #include <signal.h>
@@ -38,9 +42,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #define HIST_SIZE 8192
-#define BUF_SIZE 100
+#define BATCH_EVENTS 512 ///< Largest number of events in a data reply
+#define BUF_SIZE (4 + BATCH_EVENTS * sizeof (struct event))
+#define DISPLAY_FPS 4 ///< Updates of the plot per second
+#define PEAK_FWHM 20 ///< Width of the peaks fitted on the plot
 
 #ifdef TEST_CLIENT
 #define ADDRESS "127.0.0.1"
@@ -48,21 +56,17 @@
 #define ADDRESS "10.42.0.22"
 #endif
 
-//! \brief struct event defines the data for each SILENA ADC event
-//!
-struct event {
-  int32_t tv_sec;   ///< Event timestamp, seconds field
-  int32_t tv_usec;  ///< Event timestamp, microseconds field
-  uint32_t value;   ///< Event ADC value
-};
-
-int daq_go = 1;			///< A status variable, set to 1 when DAQ is active
+volatile sig_atomic_t daq_go = 1;	///< A status variable, set to 1 when DAQ is active
 FILE * gnuplot = NULL; ///< The file descriptor for the Gnuplot pipe
+Display_Typedef display; ///< Plots the histogram from its own thread
+Histo_Typedef histo; ///< The spectrum, filled by the main thread only
+Rate_Typedef rate; ///< Rates and inter-arrival times of the events
 
 void * context = NULL;
 void * requester = NULL;
 
 char buffer [BUF_SIZE];
+struct event events [BATCH_EVENTS]; ///< The events of the last data reply
 
 //! @brief Callback function that triggers the end of DAQ when a SIGINT signal
 //! is intercepted
@@ -85,8 +89,8 @@ void CleanExit (int code);
 //! @param size is the size of the reply buffer. The function automatically
 //! appends a terminating null-string even when the reply is truncated
 //!
-//! @return 0 on success, and -1 in case of error. If -1 is returned, the reply
-//! buffer is possibly not a c-string.
+//! @return the length of the reply on success, and -1 in case of error. If -1
+//! is returned, the reply buffer is possibly not a c-string.
 int zmq_txrx(char const * request, char * reply, int size);
 
 //! @brief Interprets the error code reported by the server
@@ -95,16 +99,21 @@ int zmq_txrx(char const * request, char * reply, int size);
 void InterpretServerError(char const * msg);
 
 int main(int argc, char * argv[]) {
-	struct event event;
-	int16_t histo [HIST_SIZE];
-	int retval, serviced;
+	Rate_Summary rates;
+	int retval;
 
 	UNUSED(argc);
 	UNUSED(argv);
 
-	// Handle interruption of DAQ program
-	if (signal(SIGINT, &SignalHandler) == SIG_ERR) {
-		PRINT_STD_LIBERROR("signal");
+	// Handle interruption of DAQ program. Without SA_RESTART the signal
+	// interrupts the blocking receive, so an idle server does not keep the
+	// client running
+	struct sigaction action;
+	memset(&action, 0, sizeof (action));
+	sigemptyset(&action.sa_mask);
+	action.sa_handler = &SignalHandler;
+	if (sigaction(SIGINT, &action, NULL) == -1) {
+		PRINT_STD_LIBERROR("sigaction");
 		CleanExit(EXIT_FAILURE);
 	}
 	
@@ -134,7 +143,15 @@ int main(int argc, char * argv[]) {
 
 	PRINT_DBGMSG("Connection started.");
 		
-	memset(histo, 0, sizeof (histo));
+	Rate_Init(&rate);
+	if (Histo_Init(&histo, HIST_SIZE, 1) == -1) {
+		PRINT_DBGMSG("Could not allocate the histogram!");
+		CleanExit(EXIT_FAILURE);
+	}
+	if (Display_Start(&display, gnuplot, HIST_SIZE, DISPLAY_FPS, PEAK_FWHM) == -1) {
+		PRINT_DBGMSG("Could not start the display thread!");
+		CleanExit(EXIT_FAILURE);
+	}
 
 	// Start the acquisition
 	retval = zmq_txrx("S", buffer, BUF_SIZE);
@@ -143,9 +160,8 @@ int main(int argc, char * argv[]) {
 		CleanExit(EXIT_FAILURE);
 	}
 
-  serviced = 0;
 	while (daq_go) {
-	  // Request data one event at a time
+	  // Request the events the server collected since the last request
 	  retval = zmq_txrx("R", buffer, BUF_SIZE);
 	  if (retval == -1) {
 	 	  PRINT_DBGMSG("Error receiving data");
@@ -156,16 +172,19 @@ int main(int argc, char * argv[]) {
 		printf("%s", buffer);
 		getc(stdin);
 		#else
-		// Populate the histogram
-		memcpy(&event, buffer, sizeof (struct event));
-		
-		if ( 0 <= event.value && event.value < HIST_SIZE) {
-	    ++histo[event.value];
-	  }
-	  
-	  if ((++serviced % 100) == 99) { // Plot every 100 events
-	    GNUPlot_Plot(gnuplot, histo, HIST_SIZE);		  
-	  }
+		// Populate the histogram, the events follow the "OK " prefix and are
+		// copied out so that the values are aligned
+		if (retval < 3 || (retval - 3) % sizeof (struct event)) {
+			PRINT_DBGMSG("Malformed data reply");
+			continue;
+		}
+		retval = (retval - 3) / sizeof (struct event);
+		memcpy(events, buffer + 3, retval * sizeof (struct event));
+		Histo_Fill(&histo, 0, &events[0].value, sizeof (struct event), retval);
+		Rate_Fill(&rate, events, retval);
+		// The display thread picks the snapshot up at its next frame
+		Rate_Summarize(&rate, time(NULL), &rates);
+		Display_Publish(&display, &histo, &rates);
 		#endif
 	}
 
@@ -176,6 +195,10 @@ int main(int argc, char * argv[]) {
 		CleanExit(EXIT_FAILURE);
 	}
 
+	Rate_Summarize(&rate, time(NULL), &rates);
+	Display_Stop(&display, &histo, &rates);
+	printf("rate %.1f ev/s over 60 s, dead time %.1f us, %.2f %%\n",
+	       rates.rate[2], rates.dead_us, 100.0 * rates.dead_fraction);
 	CleanExit(EXIT_SUCCESS);
 	return 0; // Never executed
 };
@@ -194,16 +217,16 @@ int zmq_txrx(char const * request, char * reply, int size) {
     PRINT_STD_LIBERROR("zmq_recv");
 		return -1;
 	}
-  if (retval > BUF_SIZE - 1) { // Message was truncated
+  if (retval > size - 1) { // Message was truncated
   	PRINT_DBGMSG("Received message is truncated");
 	  return -1;
 	}
-  buffer[retval] = '\0';
-	printf("zmq_txrx: received '%.3s'\n", buffer);
+  reply[retval] = '\0';
+	printf("zmq_txrx: received '%.3s'\n", reply);
 
 	// Check response for format and reported errors
-	switch ( (bool)strncmp(buffer, "OK", 2) |
-						((bool)strncmp(buffer, "ERR", 3) << 1) ) {
+	switch ( (bool)strncmp(reply, "OK", 2) |
+						((bool)strncmp(reply, "ERR", 3) << 1) ) {
 		case 0: // String is 'OK' and 'ERR' simultaneously
 			__attribute__((fallthrough));
 		case 3: // String is not 'OK' and 'ERR' simultaneously
@@ -211,11 +234,10 @@ int zmq_txrx(char const * request, char * reply, int size) {
 			PRINT_DBGMSG("Wrong format of server response");
 			retval = -1;
 			break;
-		case 2: // Server reports no error
-			retval = 0;
+		case 2: // Server reports no error, retval is the reply length
 			break;
 		case 1: // Server reports an error
-			InterpretServerError(buffer);
+			InterpretServerError(reply);
 			retval = -1;
 			break;
 	}
@@ -232,6 +254,8 @@ void SignalHandler (int signum) {
 };
 
 void CleanExit(int code) {
+	Display_Stop(&display, NULL, NULL);
+	Histo_Free(&histo);
 	if (gnuplot != NULL) {
 		pclose(gnuplot);
 	}
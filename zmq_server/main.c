@@ -24,10 +24,12 @@
  */
 
 
+#include "silenar.h"
 #include "utility.h"
 
 #include <fcntl.h>
 #include <signal.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -46,14 +48,8 @@
 #define DEV_PATH "/dev/silenar"
 #endif
 #define BUF_SIZE 100
-
-//! \brief struct event defines the data for each SILENA ADC event
-//!
-struct event {
-  int32_t tv_sec;   ///< Event timestamp, seconds field
-  int32_t tv_usec;  ///< Event timestamp, microseconds field
-  uint32_t value;   ///< Event ADC value
-};
+#define POLL_TIMEOUT 500 ///< Timeout of zmq_poll in ms, to notice SIGINT
+#define BATCH_EVENTS 512 ///< Largest number of events sent in one reply
 
 int daq_go = 1;			///< A status variable, set to 1 when DAQ is active
 int running = 0;
@@ -63,6 +59,8 @@ void * context = NULL;
 void * responder = NULL;
 
 char buffer [BUF_SIZE];
+//! The data replies, "OK " followed by the events read from the char device
+char reply [3 + BATCH_EVENTS * sizeof (struct event)] = "OK ";
 
 
 //! @brief Callback function that triggers the end of DAQ when a SIGINT signal
@@ -77,9 +75,13 @@ void SignalHandler (int signum);
 //! @param code is the termination code provided to the call of exit()
 void CleanExit (int code);
 
+//! @brief Reads the events available on the char device, up to BATCH_EVENTS,
+//! and sends them to the client as the reply to a pending data request
+void SendEvents (void);
+
 int main(int argc, char * argv[]) {
-	struct event event;
 	int retval;
+	int pending = 0;  ///< Set when a data request waits for the device
 
 	UNUSED(argc);
 	UNUSED(argv);
@@ -89,8 +91,8 @@ int main(int argc, char * argv[]) {
 		PRINT_STD_LIBERROR("signal");
 		CleanExit(EXIT_FAILURE);
 	}
-	// Open the char device
-	fd = open(DEV_PATH, O_RDWR, 0);
+	// Open the char device, reads must never block the command loop
+	fd = open(DEV_PATH, O_RDWR | O_NONBLOCK, 0);
 	if (fd == -1) {
 	  PRINT_STD_LIBERROR("open");
 	  CleanExit(EXIT_FAILURE);
@@ -107,8 +109,37 @@ int main(int argc, char * argv[]) {
 
 	PRINT_DBGMSG("Server started.");
 	
+	zmq_pollitem_t items [] = {
+	  { responder, 0, ZMQ_POLLIN, 0 },
+	  { NULL, fd, ZMQ_POLLIN | ZMQ_POLLERR, 0 }
+	};
+	
 	while (daq_go) {
-	  // Wait for a connection
+	  // Watch the char device only while a data request is pending, the REP
+	  // socket cannot receive another command before it is answered
+	  retval = zmq_poll(items, pending ? 2 : 1, POLL_TIMEOUT);
+	  if (retval == -1) {
+	    if (errno == EINTR) {
+	      continue;
+	    }
+	    PRINT_STD_LIBERROR("zmq_poll");
+	    CleanExit(EXIT_FAILURE);
+	  }
+	  if (pending && (items[1].revents & ZMQ_POLLERR)) {
+#ifndef TEST_SERVER
+	    retval = ioctl(fd, SILENAR_IOC_ACK_OVERRUN);
+	    printf("device dropped %d events\n", retval);
+#endif
+	  }
+	  if (pending && (items[1].revents & ZMQ_POLLIN)) {
+	    SendEvents();
+	    pending = 0;
+	  }
+	  if (!(items[0].revents & ZMQ_POLLIN)) {
+	    continue;
+	  }
+	  
+	  // Receive the next command
 	  retval = zmq_recv(responder, buffer, BUF_SIZE - 1, 0);
 	  if (retval == -1) {
 	    PRINT_STD_LIBERROR("zmq_recv");
@@ -152,17 +183,8 @@ int main(int argc, char * argv[]) {
 	      zmq_send(responder, "ERR 3", 5, 0);	
 	      break;    
 	    }
-	    // Read one event at a time
-	    retval = read(fd, &event, sizeof (struct event));
-	    if (retval != sizeof (struct event) || retval == -1) {	   
-	      PRINT_STD_LIBERROR("read");
-	      zmq_send(responder, "ERR 4", 5, 0);     
-	    }
-	    else {
-	      sprintf(buffer, "OK ");
-	      memcpy(buffer + 3, &event, sizeof(struct event));
-	      zmq_send(responder, buffer, sizeof(struct event) + 3, 0);
-	    }
+	    // The reply is sent as soon as the device has events
+	    pending = 1;
 	    break;
 	  default:
 	    PRINT_DBGMSG("Command not recognized.");
@@ -184,6 +206,20 @@ int main(int argc, char * argv[]) {
 };
 
 
+void SendEvents (void) {
+	ssize_t retval;
+
+	// The device fills the reply after the "OK " prefix with whole events
+	retval = read(fd, reply + 3, BATCH_EVENTS * sizeof (struct event));
+	if (retval <= 0 || retval % sizeof (struct event)) {
+	  PRINT_STD_LIBERROR("read");
+	  zmq_send(responder, "ERR 4", 5, 0);
+	}
+	else {
+	  zmq_send(responder, reply, retval + 3, 0);
+	}
+}
+
 void SignalHandler (int signum) {
 	UNUSED(signum);
 	daq_go = 0;